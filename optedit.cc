@@ -3,14 +3,73 @@
 #include <string>
 #include <array>
 #include <list>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <system_error>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+#include <exception>
+#include <future>
+#include <chrono>
 
-enum EditType { SKIP = 0, DELETE = 1, INSERT = 2, REPLACE = 3 };
+#if defined (__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#endif
 
-typedef std::array<unsigned, 4> EditCosts;
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+// TRANSPOSE swaps two adjacent characters, so "ab" becomes "ba".
+//
+enum EditType { SKIP = 0, DELETE = 1, INSERT = 2, REPLACE = 3, TRANSPOSE = 4 };
+
+// An edit cost which prevents that type of edit from being used at
+// all.  Currently this is only allowed for TRANSPOSE.
+//
+const unsigned DISALLOWED = std::numeric_limits<unsigned>::max ();
+
+// The cost of each type of edit, indexed by EditType.  Costs written
+// with only the original four types, such as { 1, 10, 15, 5 },
+// don't allow transpositions.
+//
+struct EditCosts : std::array<unsigned, 5>
+{
+  EditCosts () : std::array<unsigned, 5> () { }
+  EditCosts (unsigned skip, unsigned del, unsigned ins, unsigned rep, unsigned transpose = DISALLOWED)
+    : std::array<unsigned, 5> {{ skip, del, ins, rep, transpose }}
+  { }
+};
 
 EditCosts std_edit_costs { 1, 10, 15, 5 };
-const char *edit_type_names[4] = { "SKP", "DEL", "INS", "REP" };
+const char *edit_type_names[5] = { "SKP", "DEL", "INS", "REP", "TRN" };
 
+// For a TRANSPOSE, FROM_CH and TO_CH are the first characters of the
+// pair in the from and to strings respectively.
+//
 struct Edit
 {
   Edit (EditType _type, char _from_ch, char _to_ch) : type (_type), from_ch (_from_ch), to_ch (_to_ch) { }
@@ -20,7 +79,7 @@ struct Edit
 
 std::string edit_rep (const Edit &edit)
 {
-  std::string rep (edit_type_names[edit.type]); 
+  std::string rep (edit_type_names[edit.type]);
   if (edit.type != INSERT)
     {
       rep += ' ';
@@ -34,64 +93,544 @@ std::string edit_rep (const Edit &edit)
   return rep;
 }
 
-std::list<Edit>
-compute_optimal_edits (const std::string &from, const std::string &to, const EditCosts &costs)
+// Return the sum of the costs of EDITS.
+//
+unsigned
+edits_cost (const std::list<Edit> &edits, const EditCosts &costs)
+{
+  unsigned cost = 0;
+  for (const Edit &edit : edits)
+    cost += costs[edit.type];
+  return cost;
+}
+
+inline unsigned char uchar (char ch) { return static_cast<unsigned char> (ch); }
+
+
+// Per-character edit costs, for cost models that a single EditCosts
+// can't express, such as keyboard-distance or case-insensitive
+// substitution.
+//
+// A CostTable constructed from an EditCosts gives exactly the same
+// results as the EditCosts itself; individual entries can then be
+// adjusted.  The type of each edit is still decided by comparing
+// characters, so e.g. replacing 'a' with 'A' is always a REPLACE,
+// even if the table says it costs the same as a SKIP.
+//
+struct CostTable
 {
-  struct EditNode
+  CostTable (const EditCosts &costs)
+    : subst_costs (256 * 256, costs[REPLACE]), transpose_cost (costs[TRANSPOSE])
   {
-    EditNode () : edit (SKIP, 0, 0), cost (0) { }
+    for (unsigned ch = 0; ch < 256; ch++)
+      subst_costs[ch * 256 + ch] = costs[SKIP];
+    insert_costs.fill (costs[INSERT]);
+    delete_costs.fill (costs[DELETE]);
+  }
 
-    EditNode (EditType type, char from_ch, char to_ch, unsigned _cost)
-      : edit (type, from_ch, to_ch), cost (_cost)
-    { }
+  // Return the costs of replacing any FROM character with TO_CH,
+  // indexed by the FROM character.
+  //
+  const unsigned *subst_row (char to_ch) const { return &subst_costs[uchar (to_ch) * 256]; }
 
-    Edit edit;
-    unsigned cost;
-  };
+  unsigned subst (char from_ch, char to_ch) const { return subst_row (to_ch)[uchar (from_ch)]; }
+  void set_subst (char from_ch, char to_ch, unsigned cost) { subst_costs[uchar (to_ch) * 256 + uchar (from_ch)] = cost; }
+
+  // A 256x256 matrix of substitution costs.  It is stored row-major
+  // by TO character, because the fill kernel handles one TO
+  // character at a time, and so then only needs a single row.
+  //
+  std::vector<unsigned> subst_costs;
+
+  // The cost of inserting or deleting each character.
+  //
+  std::array<unsigned, 256> insert_costs, delete_costs;
+
+  // The cost of swapping two adjacent characters, which doesn't
+  // depend on the characters.
+  //
+  unsigned transpose_cost;
+};
+
+// Make COSTS ignore case, by making substitutions between upper- and
+// lower-case versions of the same letter cost the same as a SKIP.
+//
+void make_case_insensitive (CostTable &costs)
+{
+  for (char lower = 'a'; lower <= 'z'; lower++)
+    {
+      char upper = lower - 'a' + 'A';
+      costs.set_subst (lower, upper, costs.subst (lower, lower));
+      costs.set_subst (upper, lower, costs.subst (upper, upper));
+    }
+}
+
+
+// Cost policies for the fill kernel, which abstract away where the
+// cost of each edit comes from.  START_ROW is called before each row
+// of the cost matrix is filled, with the TO character for that row.
+//
+
+// Costs which don't depend on the characters involved.  This is the
+// common case, so it's kept as cheap as possible.
+//
+class UniformCosts
+{
+public:
+
+  // What the costs are made from.
+  //
+  typedef EditCosts Source;
+
+  UniformCosts (const EditCosts &costs, const std::string &) : _costs (costs) { }
+
+  void start_row (char) { }
+
+  unsigned insert_cost () const { return _costs[INSERT]; }
+  unsigned delete_cost (unsigned) const { return _costs[DELETE]; }
+  unsigned rep_cost (unsigned, EditType rep_type) const { return _costs[rep_type]; }
+  unsigned transpose_cost () const { return _costs[TRANSPOSE]; }
+
+private:
+
+  const EditCosts &_costs;
+};
+
+// Costs taken from a CostTable.
+//
+// When starting each row, we gather the substitution costs for the
+// TO character into a "profile" row parallel to FROM, so the inner
+// loop of the kernel only does sequential loads, like it does for
+// UniformCosts.  Delete costs only depend on FROM, so their profile
+// is computed just once.  The gather loop has no dependencies
+// between iterations, so the compiler can use vector gather
+// instructions for it where the target has them.
+//
+class TableCosts
+{
+public:
+
+  typedef CostTable Source;
+
+  TableCosts (const CostTable &table, const std::string &from)
+    : _table (table), _from_chars (from.begin (), from.end ()),
+      _delete_costs (from.length ()), _rep_costs (from.length ())
+  {
+    for (unsigned from_idx = 0; from_idx < from.length (); from_idx++)
+      _delete_costs[from_idx] = table.delete_costs[_from_chars[from_idx]];
+  }
+
+  void start_row (char to_ch)
+  {
+    const unsigned *subst_row = _table.subst_row (to_ch);
+    const unsigned char *from_chars = _from_chars.data ();
+    unsigned *rep_costs = _rep_costs.data ();
+    unsigned from_length = _from_chars.size ();
+    for (unsigned from_idx = 0; from_idx < from_length; from_idx++)
+      rep_costs[from_idx] = subst_row[from_chars[from_idx]];
+    _insert_cost = _table.insert_costs[uchar (to_ch)];
+  }
+
+  unsigned insert_cost () const { return _insert_cost; }
+  unsigned delete_cost (unsigned from_idx) const { return _delete_costs[from_idx]; }
+  unsigned rep_cost (unsigned from_idx, EditType) const { return _rep_costs[from_idx]; }
+  unsigned transpose_cost () const { return _table.transpose_cost; }
+
+private:
+
+  const CostTable &_table;
+  std::vector<unsigned char> _from_chars;
+  std::vector<unsigned> _delete_costs, _rep_costs;
+  unsigned _insert_cost = 0;
+};
+
+
+// Return the edit which leads to position TO_IDX, FROM_IDX of the
+// cost matrix when it has type TYPE, and update TO_IDX and FROM_IDX
+// to be the position it leads from.
+//
+Edit
+step_back (EditType type, const std::string &from, const std::string &to, unsigned &to_idx, unsigned &from_idx)
+{
+  char from_ch = 0, to_ch = 0;
+  if (type == TRANSPOSE)
+    {
+      from_idx -= 2;
+      to_idx -= 2;
+      return Edit (type, from[from_idx], to[to_idx]);
+    }
+  if (type != INSERT)
+    from_ch = from[--from_idx];
+  if (type != DELETE)
+    to_ch = to[--to_idx];
+  return Edit (type, from_ch, to_ch);
+}
+
+// Replay the optimal path through TRACE, which holds the EditType
+// chosen for each position of the cost matrix, in row-major order,
+// and return the resulting edits.  STEP_DONE () is called after each
+// edit.
+//
+template<class StepDoneFn>
+std::list<Edit>
+replay_edits (const std::string &from, const std::string &to, const std::vector<unsigned char> &trace,
+	      StepDoneFn step_done)
+{
+  size_t row_length = from.length () + 1;
+
+  std::list<Edit> result;
+  unsigned from_idx = from.length (), to_idx = to.length ();
+  while (from_idx > 0 || to_idx > 0)
+    {
+      EditType type = EditType (trace[to_idx * row_length + from_idx]);
+      result.push_front (step_back (type, from, to, to_idx, from_idx));
+      step_done ();
+    }
+
+  return result;
+}
+
+std::list<Edit>
+replay_edits (const std::string &from, const std::string &to, const std::vector<unsigned char> &trace)
+{
+  return replay_edits (from, to, trace, [] () { });
+}
+
+
+// Fill in row TO_IDX + 1 of the cost matrix into ROW, using the
+// previous row PREV_ROW, and record the edit chosen for each entry in
+// TRACE_ROW.  COSTS must already have been told about the row.
+//
+// If TRANSPOSE is true, transpositions are also considered, which
+// needs the row before the previous one too, PREV2_ROW; it may be
+// null when TO_IDX is zero.  This is a separate instantiation so the
+// common case doesn't pay for the extra comparisons.
+//
+template<bool Transpose, class Costs>
+inline void
+fill_edit_row (const std::string &from, const std::string &to, unsigned to_idx, const Costs &costs,
+	       const unsigned *prev2_row, const unsigned *prev_row, unsigned *row, unsigned char *trace_row)
+{
+  unsigned from_length = from.length ();
+  char to_ch = to[to_idx];
+  char prev_to_ch = (Transpose && to_idx > 0) ? to[to_idx - 1] : 0;
+
+  // The first entry in each row is always an insertion, as there's
+  // no other choice (because the from string has zero length).
+  //
+  row[0] = prev_row[0] + costs.insert_cost ();
+  trace_row[0] = INSERT;
+
+  // Fill in each remaining entry using the optimal choice from the
+  // three available predecessors, and inserting, deleting, or
+  // changing/skipping a character.
+  //
+  for (unsigned from_idx = 0; from_idx < from_length; from_idx++)
+    {
+      EditType rep_type = (from[from_idx] == to_ch) ? SKIP : REPLACE;
+
+      unsigned ins_cost = prev_row[from_idx + 1] + costs.insert_cost ();
+      unsigned del_cost = row[from_idx] + costs.delete_cost (from_idx);
+      unsigned rep_cost = prev_row[from_idx] + costs.rep_cost (from_idx, rep_type);
+
+      unsigned cost;
+      EditType type;
+      if (ins_cost < del_cost && ins_cost < rep_cost)
+	{
+	  cost = ins_cost;
+	  type = INSERT;
+	}
+      else if (del_cost < rep_cost)
+	{
+	  cost = del_cost;
+	  type = DELETE;
+	}
+      else
+	{
+	  cost = rep_cost;
+	  type = rep_type;
+	}
+
+      // A transposition is only used if it's strictly better, so
+      // ties are resolved the same way as without transpositions.
+      //
+      if (Transpose && to_idx > 0 && from_idx > 0
+	  && from[from_idx - 1] == to_ch && from[from_idx] == prev_to_ch
+	  && from[from_idx] != to_ch)
+	{
+	  unsigned trn_cost = prev2_row[from_idx - 1] + costs.transpose_cost ();
+	  if (trn_cost < cost)
+	    {
+	      cost = trn_cost;
+	      type = TRANSPOSE;
+	    }
+	}
+
+      row[from_idx + 1] = cost;
+      trace_row[from_idx + 1] = type;
+    }
+}
+
+// Fill in the initial row of the cost matrix into ROW (and TRACE_ROW),
+// which corresponds to deleting everything in FROM to get a
+// zero-length string.
+//
+template<class Costs>
+inline void
+fill_first_edit_row (const std::string &from, const Costs &costs, unsigned *row, unsigned char *trace_row)
+{
+  row[0] = 0;
+  trace_row[0] = SKIP;
+  for (unsigned from_idx = 0; from_idx < from.length (); from_idx++)
+    {
+      row[from_idx + 1] = row[from_idx] + costs.delete_cost (from_idx);
+      trace_row[from_idx + 1] = DELETE;
+    }
+}
+
+// Fill in rows FIRST_TO_IDX + 1 to END_TO_IDX of the cost matrix,
+// starting with PREV_ROW holding row FIRST_TO_IDX (and PREV2_ROW the
+// one before it, if transpositions are allowed).  TRACE_ROW (TO_IDX)
+// says where to record the edits for row TO_IDX + 1, and ROW_DONE
+// (TO_IDX) is called when it's finished, at which point it's in
+// PREV_ROW.  All three rows must have FROM.length () + 1 entries.
+//
+template<class Costs, class TraceRowFn, class RowDoneFn>
+void
+fill_edit_rows (const std::string &from, const std::string &to, Costs &costs,
+		unsigned first_to_idx, unsigned end_to_idx,
+		std::vector<unsigned> &prev2_row, std::vector<unsigned> &prev_row, std::vector<unsigned> &row,
+		TraceRowFn trace_row, RowDoneFn row_done)
+{
+  if (costs.transpose_cost () == DISALLOWED)
+    for (unsigned to_idx = first_to_idx; to_idx < end_to_idx; to_idx++)
+      {
+	costs.start_row (to[to_idx]);
+	fill_edit_row<false> (from, to, to_idx, costs, nullptr, prev_row.data (), row.data (), trace_row (to_idx));
+	std::swap (prev_row, row);
+	row_done (to_idx);
+      }
+  else
+    for (unsigned to_idx = first_to_idx; to_idx < end_to_idx; to_idx++)
+      {
+	costs.start_row (to[to_idx]);
+	fill_edit_row<true> (from, to, to_idx, costs, prev2_row.data (), prev_row.data (), row.data (), trace_row (to_idx));
+	std::swap (prev2_row, prev_row);
+	std::swap (prev_row, row);
+	row_done (to_idx);
+      }
+}
 
+// Progress policies
+//
+// compute_optimal_edits_with tells a progress policy how it's going:
+// START (FROM_LENGTH, TO_LENGTH) before filling in the matrix,
+// ROW_DONE (TO_IDX) as each row is finished, FILL_DONE () once it's
+// all filled in, STEP_DONE () after each edit of the traceback, and
+// FINISH () at the end.  Any of them may throw to abandon the
+// computation.  NoProgress does nothing, and compiles away entirely.
+//
+struct NoProgress
+{
+  void start (unsigned, unsigned) { }
+  void row_done (unsigned) { }
+  void fill_done () { }
+  void step_done () { }
+  void finish () { }
+};
+
+template<class Costs, class Progress>
+std::list<Edit>
+compute_optimal_edits_with (const std::string &from, const std::string &to, Costs &costs, Progress &progress)
+{
   unsigned from_length = from.length ();
   unsigned to_length = to.length ();
+  size_t row_length = from_length + 1;
 
-  // We calculate the cost matrix a row at a time, but need to keep
-  // the entire matrix in memory so we can replay the optimal path at
-  // the end.
+  // We calculate the cost matrix a row at a time, and only need the
+  // costs in the previous row to do so (or the previous two rows,
+  // with transpositions), but need to remember the edit chosen for
+  // every entry so we can replay the optimal path at the end.
   //
   // The dimensions of the matrix are one larger than the lengths of
   // corresponding strings.
   //
-  std::vector<std::vector<EditNode> > edit_matrix;
-  for (unsigned i = 0; i < to_length+ 1; i++)
-    edit_matrix.emplace_back (from_length + 1);
+  std::vector<unsigned char> trace ((to_length + 1) * row_length);
+  std::vector<unsigned> prev2_row (row_length), prev_row (row_length), row (row_length);
+
+  progress.start (from_length, to_length);
+  fill_first_edit_row (from, costs, prev_row.data (), &trace[0]);
+  fill_edit_rows (from, to, costs, 0, to_length, prev2_row, prev_row, row,
+		  [&] (unsigned to_idx) { return &trace[(to_idx + 1) * row_length]; },
+		  [&] (unsigned to_idx) { progress.row_done (to_idx); });
+  progress.fill_done ();
+
+  // Now that we've computed all the optimal paths, replay the one
+  // which reaches the final result.
+  //
+  std::list<Edit> edits = replay_edits (from, to, trace, [&] () { progress.step_done (); });
+  progress.finish ();
+  return edits;
+}
+
+template<class Costs>
+std::list<Edit>
+compute_optimal_edits_with (const std::string &from, const std::string &to, Costs &costs)
+{
+  NoProgress progress;
+  return compute_optimal_edits_with (from, to, costs, progress);
+}
+
+std::list<Edit>
+compute_optimal_edits (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  UniformCosts uniform_costs (costs, from);
+  return compute_optimal_edits_with (from, to, uniform_costs);
+}
+
+std::list<Edit>
+compute_optimal_edits (const std::string &from, const std::string &to, const CostTable &costs)
+{
+  TableCosts table_costs (costs, from);
+  return compute_optimal_edits_with (from, to, table_costs);
+}
+
+// Scratch space for compute_edit_cost.
+//
+struct EditCostWorkspace
+{
+  std::vector<unsigned> prev2_row, prev_row, row;
+  std::vector<unsigned char> trace_row;
+};
+
+// Return the cost of the optimal edits from FROM to TO with COSTS,
+// using WORKSPACE for the rows of the matrix.
+//
+unsigned
+compute_edit_cost (const std::string &from, const std::string &to, const EditCosts &costs,
+		   EditCostWorkspace &workspace)
+{
+  size_t row_length = from.length () + 1;
+  workspace.prev2_row.resize (row_length);
+  workspace.prev_row.resize (row_length);
+  workspace.row.resize (row_length);
+  workspace.trace_row.resize (row_length);
+
+  UniformCosts uniform_costs (costs, from);
+  fill_first_edit_row (from, uniform_costs, workspace.prev_row.data (), workspace.trace_row.data ());
+  fill_edit_rows (from, to, uniform_costs, 0, to.length (), workspace.prev2_row, workspace.prev_row, workspace.row,
+		  [&] (unsigned) { return workspace.trace_row.data (); },
+		  [] (unsigned) { });
+  return workspace.prev_row[from.length ()];
+}
+
+unsigned
+compute_edit_cost (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  EditCostWorkspace workspace;
+  return compute_edit_cost (from, to, costs, workspace);
+}
+
+
+// Affine gap costs: a run of N consecutive insertions costs
+// INSERT_OPEN + N * costs[INSERT], and similarly for deletions, so
+// the optimal script prefers a few long gaps to many short ones.
+// With both opening costs zero, the result costs the same as with
+// plain EditCosts.
+//
+struct GapCosts
+{
+  unsigned insert_open, delete_open;
+};
+
+// Compute optimal edits with affine gap costs, using Gotoh's
+// three-state recurrence.  As well as the best cost of reaching each
+// position, we track the best cost of reaching it with a deletion
+// (which extends along the row) and with an insertion (which extends
+// down the column), so that we know when a gap is being extended
+// rather than opened.
+//
+std::list<Edit>
+compute_optimal_edits (const std::string &from, const std::string &to, const EditCosts &costs, const GapCosts &gaps)
+{
+  // Large enough to never be chosen, but small enough that adding
+  // an edit cost to it can't overflow.
+  //
+  const unsigned unreachable = std::numeric_limits<unsigned>::max () / 2;
+
+  // Bits in each traceback entry: the low bits hold the EditType
+  // chosen for the best cost, and the others whether the best
+  // deletion/insertion ending there extends a previous one rather
+  // than opening a new gap.
+  //
+  const unsigned char type_mask = 7, del_extends = 8, ins_extends = 16;
+
+  unsigned from_length = from.length ();
+  unsigned to_length = to.length ();
+  size_t row_length = from_length + 1;
+  bool transpose = (costs[TRANSPOSE] != DISALLOWED);
+
+  std::vector<unsigned char> trace ((to_length + 1) * row_length);
 
-  // The initial row of EDIT_MATRIX corresponds to deleting
-  // everything in FROM to get a zero-length string.
+  // Best costs for the previous and current rows (and the one before
+  // that, for transpositions), and best costs ending in an insertion
+  // for the current row, which can be updated in place.  DIAG_COSTS
+  // holds the cost of the diagonal move into each entry of the
+  // current row.
   //
+  std::vector<unsigned> prev2_row (transpose ? row_length : 0), prev_row (row_length), row (row_length);
+  std::vector<unsigned> ins_row (row_length, unreachable), diag_costs (row_length);
+
+  prev_row[0] = 0;
+  trace[0] = SKIP;
   for (unsigned from_idx = 0; from_idx < from_length; from_idx++)
     {
-      edit_matrix[0][from_idx + 1] = EditNode (DELETE, from[from_idx], 0, (from_idx + 1) * costs[DELETE]);
-//    std::cout << "EM[" << 0 << "][" << from_idx + 1 << "]: " << edit_rep (edit_matrix[0][from_idx + 1].edit) << " (cost = " << (edit_matrix[0][from_idx + 1].cost) << ")" << '\n';
+      prev_row[from_idx + 1] = gaps.delete_open + (from_idx + 1) * costs[DELETE];
+      trace[from_idx + 1] = DELETE | (from_idx > 0 ? del_extends : 0);
     }
 
-  // Now scan through the matrix a row at a time, filling in each node
-  // using the optimal choice from the three available predecessors,
-  // and inserting, deleting, or changing/skipping a character.
-  //
   for (unsigned to_idx = 0; to_idx < to_length; to_idx++)
     {
-      // The first entry in each row is always an insertion, as
-      // there's no other choice (because the from string has zero
-      // length).
+      char to_ch = to[to_idx];
+      unsigned char *trace_row = &trace[(to_idx + 1) * row_length];
+
+      // First the parts which only depend on the previous row: the
+      // best insertion and the diagonal move into each entry.  These
+      // have no dependencies between iterations, so the compiler can
+      // vectorize them.
       //
-      edit_matrix[to_idx + 1][0] = EditNode (INSERT, 0, to[to_idx], (to_idx + 1) * costs[INSERT]);
-//    std::cout << "EM[" << to_idx + 1 << "][" << 0 << "]: " << edit_rep (edit_matrix[to_idx + 1][0].edit) << " (cost = " << (edit_matrix[to_idx + 1][0].cost) << ")" << '\n';
+      for (unsigned from_idx = 0; from_idx <= from_length; from_idx++)
+	{
+	  unsigned extend_cost = ins_row[from_idx] + costs[INSERT];
+	  unsigned open_cost = prev_row[from_idx] + gaps.insert_open + costs[INSERT];
+	  ins_row[from_idx] = (extend_cost <= open_cost) ? extend_cost : open_cost;
+	  trace_row[from_idx] = (extend_cost <= open_cost) ? ins_extends : 0;
+	}
+      for (unsigned from_idx = 0; from_idx < from_length; from_idx++)
+	diag_costs[from_idx + 1] = prev_row[from_idx] + costs[from[from_idx] == to_ch ? SKIP : REPLACE];
 
+      // Then the deletions, which run along the row, so have to be
+      // done sequentially.
+      //
+      row[0] = ins_row[0];
+      trace_row[0] |= INSERT;
+      unsigned del_cost = unreachable;
       for (unsigned from_idx = 0; from_idx < from_length; from_idx++)
 	{
-	  EditType rep_type = (from[from_idx] == to[to_idx]) ? SKIP : REPLACE;
+	  unsigned extend_cost = del_cost + costs[DELETE];
+	  unsigned open_cost = row[from_idx] + gaps.delete_open + costs[DELETE];
+	  unsigned char entry = trace_row[from_idx + 1];
+	  if (extend_cost <= open_cost)
+	    {
+	      del_cost = extend_cost;
+	      entry |= del_extends;
+	    }
+	  else
+	    del_cost = open_cost;
 
-	  unsigned ins_cost = edit_matrix[to_idx - 1 + 1][from_idx + 1].cost + costs[INSERT];
-	  unsigned del_cost = edit_matrix[to_idx + 1][from_idx - 1 + 1].cost + costs[DELETE];
-	  unsigned rep_cost = edit_matrix[to_idx - 1 + 1][from_idx - 1 + 1].cost + costs[rep_type];
+	  unsigned ins_cost = ins_row[from_idx + 1];
+	  unsigned rep_cost = diag_costs[from_idx + 1];
+	  EditType rep_type = (from[from_idx] == to_ch) ? SKIP : REPLACE;
 
 	  unsigned cost;
 	  EditType type;
@@ -111,43 +650,6224 @@ compute_optimal_edits (const std::string &from, const std::string &to, const Edi
 	      type = rep_type;
 	    }
 
-	  edit_matrix[to_idx + 1][from_idx + 1] = EditNode (type, from[from_idx], to[to_idx], cost);
-//     	  std::cout << "EM[" << to_idx + 1 << "][" << from_idx + 1 << "]: " << edit_rep (edit_matrix[to_idx + 1][from_idx + 1].edit) << " (cost = " << (edit_matrix[to_idx + 1][from_idx + 1].cost) << ")" << '\n';
+	  if (transpose && to_idx > 0 && from_idx > 0
+	      && from[from_idx - 1] == to_ch && from[from_idx] == to[to_idx - 1]
+	      && from[from_idx] != to_ch)
+	    {
+	      unsigned trn_cost = prev2_row[from_idx - 1] + costs[TRANSPOSE];
+	      if (trn_cost < cost)
+		{
+		  cost = trn_cost;
+		  type = TRANSPOSE;
+		}
+	    }
+
+	  row[from_idx + 1] = cost;
+	  trace_row[from_idx + 1] = entry | type;
 	}
+
+      if (transpose)
+	std::swap (prev2_row, prev_row);
+      std::swap (prev_row, row);
     }
 
-  // Now that we've computed all the optimal paths, replace the one
-  // which reaches the final result.  We start replaying from the
-  // final position.
+  // Replay the optimal path, keeping track of whether we're in the
+  // middle of a gap, in which case the type of edit is implied by
+  // the gap rather than the entry's best choice.
   //
   std::list<Edit> result;
   unsigned from_idx = from_length, to_idx = to_length;
+  EditType gap = SKIP;
   while (from_idx > 0 || to_idx > 0)
     {
-      const Edit &edit = edit_matrix[to_idx][from_idx].edit;
-      result.push_front (edit);
-      if (edit.type != INSERT)
-	from_idx--;
-      if (edit.type != DELETE)
-	to_idx--;
+      unsigned char entry = trace[to_idx * row_length + from_idx];
+      EditType type = (gap == SKIP) ? EditType (entry & type_mask) : gap;
+      if (type == DELETE)
+	gap = (entry & del_extends) ? DELETE : SKIP;
+      else if (type == INSERT)
+	gap = (entry & ins_extends) ? INSERT : SKIP;
+      result.push_front (step_back (type, from, to, to_idx, from_idx));
     }
 
   return result;
 }
 
 
-int main (int argc, const char **argv)
+// Wavefront alignment
+//
+// For similar strings, most of the cost matrix is far from the
+// optimal path.  The wavefront algorithm (WFA) instead tracks, for
+// each possible cost and each diagonal of the matrix, the furthest
+// position along the diagonal reachable with exactly that cost.
+// Each wavefront is derived from earlier ones by a single edit, then
+// extended for free along runs of matching characters, so the work
+// is O((N+M) * S) for an optimal cost of S.
+//
+// This requires that matching characters cost nothing, which isn't
+// true of EditCosts in general (std_edit_costs charges for a SKIP).
+// However every path through the matrix makes the same number of
+// moves in each direction, so charging SKIP/2 for each character
+// consumed from either string instead of for each diagonal move gives
+// the same total.  Doubling to keep things integral, the cost of a
+// path is then (N+M)*SKIP/2 plus half the sum of "penalties":
+//
+//   mismatch: 2 * (REPLACE - SKIP)
+//   insert:   2 * INSERT - SKIP
+//   delete:   2 * DELETE - SKIP
+//
+// The wavefront engine can be used as long as these are all positive
+// (and there are no transpositions).
+//
+
+struct WavefrontPenalties
+{
+  // Penalties are divided by their GCD, so SCALE is what each step
+  // of the score is worth in doubled cost.
+  //
+  unsigned mismatch, insert, del, scale;
+};
+
+// Return true if COSTS can be handled by the wavefront engine, and if
+// so, set PENALTIES appropriately.
+//
+bool
+get_wavefront_penalties (const EditCosts &costs, WavefrontPenalties &penalties)
+{
+  if (costs[TRANSPOSE] != DISALLOWED
+      || costs[REPLACE] <= costs[SKIP]
+      || 2 * costs[INSERT] <= costs[SKIP] || 2 * costs[DELETE] <= costs[SKIP])
+    return false;
+
+  unsigned mismatch = 2 * (costs[REPLACE] - costs[SKIP]);
+  unsigned insert = 2 * costs[INSERT] - costs[SKIP];
+  unsigned del = 2 * costs[DELETE] - costs[SKIP];
+
+  unsigned scale = mismatch;
+  for (unsigned penalty : { insert, del })
+    {
+      unsigned a = scale, b = penalty;
+      while (b != 0)
+	{
+	  unsigned rem = a % b;
+	  a = b;
+	  b = rem;
+	}
+      scale = a;
+    }
+
+  penalties.mismatch = mismatch / scale;
+  penalties.insert = insert / scale;
+  penalties.del = del / scale;
+  penalties.scale = scale;
+  return true;
+}
+
+// Return the position after following matching characters in FROM
+// and TO starting at FROM_IDX and TO_IDX.  Eight characters are
+// compared at a time where possible, using the position of the
+// lowest set bit of their XOR to find the first mismatch.
+//
+inline unsigned
+extend_match (const std::string &from, const std::string &to, unsigned from_idx, unsigned to_idx)
 {
-  if (argc != 3)
+  unsigned from_length = from.length (), to_length = to.length ();
+
+#if defined (__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (from_idx + 8 <= from_length && to_idx + 8 <= to_length)
     {
-      std::cerr << "Usage: " << argv[0] << " FROM TO\n";
-      return 1;
+      uint64_t from_word, to_word;
+      memcpy (&from_word, from.data () + from_idx, 8);
+      memcpy (&to_word, to.data () + to_idx, 8);
+      uint64_t diff = from_word ^ to_word;
+      if (diff != 0)
+	return from_idx + __builtin_ctzll (diff) / 8;
+      from_idx += 8;
+      to_idx += 8;
+    }
+#endif
+
+  while (from_idx < from_length && to_idx < to_length && from[from_idx] == to[to_idx])
+    {
+      from_idx++;
+      to_idx++;
+    }
+
+  return from_idx;
+}
+
+// The furthest-reaching FROM index on each diagonal from LO to HI for
+// a particular score, where diagonal K holds positions with
+// FROM_IDX - TO_IDX == K.
+//
+struct Wavefront
+{
+  static const int none = std::numeric_limits<int>::min () / 2;
+
+  int offset (int diag) const { return (diag < lo || diag > hi) ? none : offsets[diag - lo]; }
+
+  int lo = 0, hi = -1;
+  std::vector<int> offsets;
+};
+
+// Compute optimal edits with the wavefront engine, returning true and
+// setting EDITS to them if they cost at most MAX_COST, or returning
+// false as soon as it's clear they would cost more.  COSTS must be
+// suitable for get_wavefront_penalties.  The edits are optimal, but
+// where there's a tie, may not be the same as compute_optimal_edits
+// would return.
+//
+bool
+compute_wavefront_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+			 unsigned max_cost, std::list<Edit> &edits)
+{
+  WavefrontPenalties penalties;
+  get_wavefront_penalties (costs, penalties);
+
+  int from_length = from.length (), to_length = to.length ();
+  int final_diag = from_length - to_length;
+
+  // The highest score within MAX_COST.
+  //
+  int64_t max_doubled_cost = 2 * int64_t (max_cost) - int64_t (costs[SKIP]) * (from_length + to_length);
+  if (max_doubled_cost < 0)
+    return false;
+  uint64_t max_score = max_doubled_cost / penalties.scale;
+
+  // The wavefronts for each score so far, which we keep so that we
+  // can trace back through them.
+  //
+  std::vector<Wavefront> wavefronts (1);
+  wavefronts[0].lo = wavefronts[0].hi = 0;
+  wavefronts[0].offsets.push_back (extend_match (from, to, 0, 0));
+
+  static const Wavefront no_wavefront;
+  auto wavefront = [&] (unsigned score, unsigned penalty) -> const Wavefront &
+    {
+      return score >= penalty ? wavefronts[score - penalty] : no_wavefront;
+    };
+
+  // Return the position on diagonal DIAG reached from the source
+  // wavefronts for SCORE by a mismatch, deletion, or insertion, or
+  // Wavefront::none if it can't be reached that way.
+  //
+  auto mismatch_source = [&] (unsigned score, int diag)
+    {
+      int offset = wavefront (score, penalties.mismatch).offset (diag);
+      return (offset != Wavefront::none && offset < from_length && offset - diag < to_length)
+	? offset + 1 : Wavefront::none;
+    };
+  auto delete_source = [&] (unsigned score, int diag)
+    {
+      int offset = wavefront (score, penalties.del).offset (diag - 1);
+      return (offset != Wavefront::none && offset < from_length) ? offset + 1 : Wavefront::none;
+    };
+  auto insert_source = [&] (unsigned score, int diag)
+    {
+      int offset = wavefront (score, penalties.insert).offset (diag + 1);
+      return (offset != Wavefront::none && offset - diag <= to_length) ? offset : Wavefront::none;
+    };
+
+  unsigned score = 0;
+  while (wavefronts[score].offset (final_diag) != from_length)
+    {
+      if (++score > max_score)
+	return false;
+
+      // The new wavefront covers the diagonals of the source
+      // wavefronts, shifted by the diagonal move each edit makes.
+      //
+      Wavefront wf;
+      wf.lo = std::numeric_limits<int>::max ();
+      wf.hi = std::numeric_limits<int>::min ();
+      const std::pair<unsigned, int> sources[] = {
+	{ penalties.mismatch, 0 }, { penalties.del, 1 }, { penalties.insert, -1 }
+      };
+      for (const auto &source : sources)
+	{
+	  const Wavefront &source_wf = wavefront (score, source.first);
+	  if (source_wf.lo <= source_wf.hi)
+	    {
+	      wf.lo = std::min (wf.lo, source_wf.lo + source.second);
+	      wf.hi = std::max (wf.hi, source_wf.hi + source.second);
+	    }
+	}
+      wf.lo = std::max (wf.lo, -to_length);
+      wf.hi = std::min (wf.hi, from_length);
+
+      if (wf.lo <= wf.hi)
+	{
+	  wf.offsets.resize (wf.hi - wf.lo + 1);
+	  for (int diag = wf.lo; diag <= wf.hi; diag++)
+	    {
+	      int offset = std::max ({ mismatch_source (score, diag), delete_source (score, diag),
+				       insert_source (score, diag) });
+	      if (offset != Wavefront::none)
+		offset = extend_match (from, to, offset, offset - diag);
+	      wf.offsets[diag - wf.lo] = offset;
+	    }
+	}
+
+      wavefronts.push_back (std::move (wf));
+    }
+
+  // Trace back from the end.  At each step we're at the
+  // furthest-reaching position for SCORE on DIAG; the edit that led
+  // to it is whichever source reaches furthest (preferring a
+  // mismatch, then a deletion, in case of ties), followed by a run of
+  // matches.  Following furthest-reaching paths takes matches as
+  // early as possible, so among equally cheap paths, this doesn't
+  // necessarily pick the one compute_optimal_edits does.
+  //
+  edits.clear ();
+  unsigned from_idx = from_length, to_idx = to_length;
+  int diag = final_diag;
+  for (;;)
+    {
+      int start = 0;
+      EditType type = SKIP;
+      if (score > 0)
+	{
+	  int mismatch = mismatch_source (score, diag);
+	  int del = delete_source (score, diag);
+	  int ins = insert_source (score, diag);
+	  start = std::max ({ mismatch, del, ins });
+	  type = (start == mismatch) ? REPLACE : (start == del) ? DELETE : INSERT;
+	}
+
+      while (int (from_idx) > start)
+	edits.push_front (step_back (SKIP, from, to, to_idx, from_idx));
+
+      if (score == 0)
+	break;
+
+      edits.push_front (step_back (type, from, to, to_idx, from_idx));
+      if (type == REPLACE)
+	score -= penalties.mismatch;
+      else if (type == DELETE)
+	{
+	  score -= penalties.del;
+	  diag--;
+	}
+      else
+	{
+	  score -= penalties.insert;
+	  diag++;
+	}
     }
 
-  std::list<Edit> edits = compute_optimal_edits (argv[1], argv[2], std_edit_costs);
+  return true;
+}
+
+// Return optimal edits from FROM to TO with COSTS, using the
+// wavefront engine if COSTS allow it.  As above, where there's a tie,
+// they may not be the same as compute_optimal_edits would return.
+//
+std::list<Edit>
+compute_wavefront_edits (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  WavefrontPenalties penalties;
+  if (! get_wavefront_penalties (costs, penalties))
+    return compute_optimal_edits (from, to, costs);
+
+  std::list<Edit> edits;
+  compute_wavefront_edits (from, to, costs, DISALLOWED, edits);
+  return edits;
+}
+
+
+// Banded computation
+//
+// If the optimal path stays close to the main diagonal, we can get
+// away with only computing a band of diagonals around it.  Where
+// diagonal K holds the entries with FROM_IDX - TO_IDX == K, the band
+// has to include diagonals 0 (where the path starts) and
+// FROM_LENGTH - TO_LENGTH (where it ends).
+//
+
+// Return a lower bound on the cost of any path which leaves the band
+// of diagonals LO to HI, or DISALLOWED if no path can.
+//
+// Getting to a diagonal K above the band needs at least K deletions,
+// and then enough insertions to get back to the final diagonal, and
+// similarly for diagonals below the band.  Every other character is
+// consumed by a diagonal move, which costs at least the cheapest of
+// SKIP, REPLACE or half a TRANSPOSE.
+//
+unsigned
+band_exit_lower_bound (unsigned from_length, unsigned to_length, const EditCosts &costs, int lo, int hi)
+{
+  int64_t diag_cost = std::min (costs[SKIP], costs[REPLACE]);
+  if (costs[TRANSPOSE] != DISALLOWED)
+    diag_cost = std::min<int64_t> (diag_cost, costs[TRANSPOSE] / 2);
+
+  int64_t final_diag = int64_t (from_length) - int64_t (to_length);
+
+  // The cheapest path with at least MIN_DELETES deletions.  The cost
+  // is linear in the number of deletions, so it's minimal at one of
+  // the extremes.
+  //
+  auto min_cost = [&] (int64_t min_deletes) -> int64_t
+    {
+      int64_t best = std::numeric_limits<int64_t>::max ();
+      for (int64_t deletes : { min_deletes, int64_t (from_length) })
+	if (deletes >= min_deletes && deletes <= int64_t (from_length) && deletes - final_diag >= 0)
+	  best = std::min (best, deletes * costs[DELETE] + (deletes - final_diag) * costs[INSERT]
+			   + (int64_t (from_length) - deletes) * diag_cost);
+      return best;
+    };
+
+  int64_t bound = std::min (min_cost (hi + 1), min_cost (final_diag - (lo - 1)));
+  return (bound >= int64_t (DISALLOWED)) ? DISALLOWED : unsigned (bound);
+}
 
+// Compute the optimal edits using only the diagonals from LO to HI,
+// setting COST to their total cost, and EDITS to the edits.  LO must
+// be at most min (0, FROM_LENGTH - TO_LENGTH) and HI at least
+// max (0, FROM_LENGTH - TO_LENGTH).
+//
+// The result is the same as compute_optimal_edits if it costs less
+// than band_exit_lower_bound for the band: then any path through an
+// entry outside the band is strictly worse, so can never win a
+// comparison against a path inside it, and so ties are broken the
+// same way as in the full computation.
+//
+void
+compute_band_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+		    int lo, int hi, unsigned &cost, std::list<Edit> &edits)
+{
+  const unsigned unreachable = std::numeric_limits<unsigned>::max () / 4;
+
+  int from_length = from.length (), to_length = to.length ();
+  bool transpose = (costs[TRANSPOSE] != DISALLOWED);
+
+  // Each row holds the band's entries in order of diagonal, so the
+  // entry above is one further along in the previous row, and the
+  // entry diagonally above-left is at the same position.
+  //
+  unsigned width = hi - lo + 1;
+  std::vector<unsigned char> trace ((to_length + 1) * size_t (width));
+  std::vector<unsigned> prev2_row (transpose ? width + 1 : 0, unreachable);
+  std::vector<unsigned> prev_row (width + 1, unreachable), row (width + 1, unreachable);
+
+  for (unsigned pos = 0; pos < width; pos++)
+    {
+      int from_idx = lo + int (pos);
+      if (from_idx >= 0 && from_idx <= from_length)
+	{
+	  prev_row[pos] = from_idx * costs[DELETE];
+	  trace[pos] = (from_idx == 0) ? SKIP : DELETE;
+	}
+    }
+
+  for (int to_idx = 0; to_idx < to_length; to_idx++)
+    {
+      char to_ch = to[to_idx];
+      unsigned char *trace_row = &trace[(to_idx + 1) * size_t (width)];
+
+      for (unsigned pos = 0; pos < width; pos++)
+	{
+	  int from_idx = to_idx + lo + int (pos);   // the entry is at FROM_IDX + 1
+	  if (from_idx < -1 || from_idx >= from_length)
+	    {
+	      row[pos] = unreachable;
+	      continue;
+	    }
+
+	  if (from_idx == -1)
+	    {
+	      row[pos] = prev_row[pos + 1] + costs[INSERT];
+	      trace_row[pos] = INSERT;
+	      continue;
+	    }
+
+	  EditType rep_type = (from[from_idx] == to_ch) ? SKIP : REPLACE;
+
+	  unsigned ins_cost = prev_row[pos + 1] + costs[INSERT];
+	  unsigned del_cost = (pos > 0 ? row[pos - 1] : unreachable) + costs[DELETE];
+	  unsigned rep_cost = prev_row[pos] + costs[rep_type];
+
+	  unsigned best;
+	  EditType type;
+	  if (ins_cost < del_cost && ins_cost < rep_cost)
+	    {
+	      best = ins_cost;
+	      type = INSERT;
+	    }
+	  else if (del_cost < rep_cost)
+	    {
+	      best = del_cost;
+	      type = DELETE;
+	    }
+	  else
+	    {
+	      best = rep_cost;
+	      type = rep_type;
+	    }
+
+	  if (transpose && to_idx > 0 && from_idx > 0
+	      && from[from_idx - 1] == to_ch && from[from_idx] == to[to_idx - 1]
+	      && from[from_idx] != to_ch)
+	    {
+	      unsigned trn_cost = prev2_row[pos] + costs[TRANSPOSE];
+	      if (trn_cost < best)
+		{
+		  best = trn_cost;
+		  type = TRANSPOSE;
+		}
+	    }
+
+	  row[pos] = std::min (best, unreachable);
+	  trace_row[pos] = type;
+	}
+
+      if (transpose)
+	std::swap (prev2_row, prev_row);
+      std::swap (prev_row, row);
+    }
+
+  cost = prev_row[from_length - to_length - lo];
+
+  edits.clear ();
+  unsigned from_idx = from_length, to_idx = to_length;
+  while (from_idx > 0 || to_idx > 0)
+    {
+      EditType type = EditType (trace[to_idx * size_t (width) + (int (from_idx) - int (to_idx) - lo)]);
+      edits.push_front (step_back (type, from, to, to_idx, from_idx));
+    }
+}
+
+// Compute the same optimal edits as compute_optimal_edits, but using
+// Ukkonen's band-doubling: start with a narrow band, and keep
+// doubling it until the result is provably optimal.  This takes
+// O((N+M) * D) time, where D is roughly the number of edits, without
+// needing to know D in advance.
+//
+std::list<Edit>
+compute_banded_edits (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  int from_length = from.length (), to_length = to.length ();
+  int final_diag = from_length - to_length;
+
+  std::list<Edit> edits;
+  for (int margin = 16; ; margin *= 2)
+    {
+      int lo = std::min (0, final_diag) - margin;
+      int hi = std::max (0, final_diag) + margin;
+      bool whole_matrix = (lo <= -to_length && hi >= from_length);
+      if (whole_matrix)
+	{
+	  lo = -to_length;
+	  hi = from_length;
+	}
+
+      unsigned cost;
+      compute_band_edits (from, to, costs, lo, hi, cost, edits);
+
+      if (whole_matrix || cost < band_exit_lower_bound (from_length, to_length, costs, lo, hi))
+	return edits;
+    }
+}
+
+// Set LO and HI to the narrowest band such that any path leaving it
+// costs more than MAX_COST.
+//
+void
+band_for_cost_bound (unsigned from_length, unsigned to_length, const EditCosts &costs, unsigned max_cost,
+		     int &lo, int &hi)
+{
+  int final_diag = int (from_length) - int (to_length);
+  int max_margin = std::max (from_length, to_length);
+
+  auto band_ok = [&] (int margin)
+    {
+      return (margin >= max_margin
+	      || band_exit_lower_bound (from_length, to_length, costs,
+					std::min (0, final_diag) - margin, std::max (0, final_diag) + margin) > max_cost);
+    };
+
+  int too_narrow = -1, margin = 1;
+  while (! band_ok (margin))
+    {
+      too_narrow = margin;
+      margin *= 2;
+    }
+  while (margin - too_narrow > 1)
+    {
+      int mid = too_narrow + (margin - too_narrow) / 2;
+      if (band_ok (mid))
+	margin = mid;
+      else
+	too_narrow = mid;
+    }
+
+  lo = std::max (std::min (0, final_diag) - margin, -int (to_length));
+  hi = std::min (std::max (0, final_diag) + margin, int (from_length));
+}
+
+// Compute the same optimal edits as compute_optimal_edits, if they
+// cost at most MAX_COST, using the narrowest band that can contain
+// such a path.  Returns true and sets EDITS if so, or false if the
+// edits would cost more.
+//
+bool
+compute_banded_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+		      unsigned max_cost, std::list<Edit> &edits)
+{
+  int lo, hi;
+  band_for_cost_bound (from.length (), to.length (), costs, max_cost, lo, hi);
+
+  unsigned cost;
+  compute_band_edits (from, to, costs, lo, hi, cost, edits);
+  if (cost > max_cost)
+    {
+      edits.clear ();
+      return false;
+    }
+  return true;
+}
+
+
+// Heuristic search
+//
+// With asymmetric costs such as std_edit_costs, most of the cost
+// matrix can't be on the optimal path.  compute_astar_edits treats
+// the matrix as a graph, and does a best-first (A*) search of it,
+// guided by a lower bound on the cost of getting from each entry to
+// the end, so only entries which might be on the optimal path are
+// visited.
+//
+
+// A lower bound on the cost of transforming the rest of a FROM string
+// into the rest of a TO string, computed from just their lengths and
+// their character histograms.
+//
+// Any path consumes the remaining characters with some number K of
+// diagonal moves plus deletions and insertions for the others.  At
+// most MATCHABLE of the diagonal moves can be SKIPs, where MATCHABLE
+// is the size of the intersection of the histograms; the others cost
+// at least REPLACE (or half a TRANSPOSE, which covers two).  The
+// total is piecewise linear in K, so its minimum is at K == 0, K ==
+// MATCHABLE or K == min (FROM_LEFT, TO_LEFT).
+//
+// The bound is consistent (it never drops by more than the cost of
+// an edit), so A* never needs to revisit an entry.
+//
+unsigned
+edit_cost_lower_bound (unsigned from_left, unsigned to_left, unsigned matchable, const EditCosts &costs)
+{
+  uint64_t match_cost = costs[SKIP];
+  uint64_t mismatch_cost = costs[REPLACE];
+  if (costs[TRANSPOSE] != DISALLOWED)
+    mismatch_cost = std::min<uint64_t> (mismatch_cost, costs[TRANSPOSE] / 2);
+  match_cost = std::min (match_cost, mismatch_cost);
+
+  auto cost_with_diag_moves = [&] (uint64_t diag_moves) -> uint64_t
+    {
+      uint64_t matches = std::min<uint64_t> (diag_moves, matchable);
+      return (from_left - diag_moves) * costs[DELETE] + (to_left - diag_moves) * costs[INSERT]
+	+ matches * match_cost + (diag_moves - matches) * mismatch_cost;
+    };
+
+  uint64_t max_diag_moves = std::min (from_left, to_left);
+  uint64_t bound = std::min ({ cost_with_diag_moves (0),
+			       cost_with_diag_moves (std::min<uint64_t> (matchable, max_diag_moves)),
+			       cost_with_diag_moves (max_diag_moves) });
+  return std::min<uint64_t> (bound, DISALLOWED);
+}
+
+// Suffix character histograms for a pair of strings, for computing
+// edit_cost_lower_bound at any pair of positions.
+//
+// Only characters that occur in both strings can ever match, so the
+// histograms only count those, which keeps them small for the usual
+// alphabets.
+//
+class SuffixHistograms
+{
+public:
+
+  SuffixHistograms (const std::string &from, const std::string &to)
+  {
+    std::array<bool, 256> in_from {}, in_to {};
+    for (char ch : from)
+      in_from[uchar (ch)] = true;
+    for (char ch : to)
+      in_to[uchar (ch)] = true;
+
+    _char_index.fill (-1);
+    for (unsigned ch = 0; ch < 256; ch++)
+      if (in_from[ch] && in_to[ch])
+	_char_index[ch] = _alphabet_size++;
+
+    count_suffixes (from, _from_counts);
+    count_suffixes (to, _to_counts);
+  }
+
+  // Return the size of the intersection of the histograms of the
+  // suffixes of FROM and TO starting at FROM_IDX and TO_IDX.
+  //
+  unsigned matchable (unsigned from_idx, unsigned to_idx) const
+  {
+    const unsigned *from_counts = _from_counts.data () + from_idx * size_t (_alphabet_size);
+    const unsigned *to_counts = _to_counts.data () + to_idx * size_t (_alphabet_size);
+    unsigned total = 0;
+    for (unsigned idx = 0; idx < _alphabet_size; idx++)
+      total += std::min (from_counts[idx], to_counts[idx]);
+    return total;
+  }
+
+private:
+
+  void count_suffixes (const std::string &str, std::vector<unsigned> &counts)
+  {
+    // With no characters in common, there's nothing to count, and
+    // COUNTS stays empty.
+    //
+    if (_alphabet_size == 0)
+      return;
+
+    counts.assign ((str.length () + 1) * size_t (_alphabet_size), 0);
+    for (unsigned idx = str.length (); idx > 0; idx--)
+      {
+	std::copy_n (&counts[idx * size_t (_alphabet_size)], _alphabet_size,
+		     &counts[(idx - 1) * size_t (_alphabet_size)]);
+	int char_index = _char_index[uchar (str[idx - 1])];
+	if (char_index >= 0)
+	  counts[(idx - 1) * size_t (_alphabet_size) + char_index]++;
+      }
+  }
+
+  std::array<int, 256> _char_index;
+  unsigned _alphabet_size = 0;
+  std::vector<unsigned> _from_counts, _to_counts;
+};
+
+std::list<Edit>
+compute_astar_edits (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  const unsigned unreachable = std::numeric_limits<unsigned>::max () / 4;
+
+  unsigned from_length = from.length (), to_length = to.length ();
+  bool transpose = (costs[TRANSPOSE] != DISALLOWED);
+
+  SuffixHistograms histograms (from, to);
+  auto heuristic = [&] (unsigned to_idx, unsigned from_idx)
+    {
+      return edit_cost_lower_bound (from_length - from_idx, to_length - to_idx,
+				    histograms.matchable (from_idx, to_idx), costs);
+    };
+
+  // The best known cost of reaching each entry we've seen so far,
+  // and whether it's final.
+  //
+  struct Node
+  {
+    unsigned cost;
+    bool closed;
+  };
+  std::unordered_map<uint64_t, Node> nodes;
+  auto key = [&] (unsigned to_idx, unsigned from_idx) { return uint64_t (to_idx) * (from_length + 1) + from_idx; };
+
+  // Entries waiting to be expanded, in buckets indexed by their
+  // estimated total cost minus BASE_ESTIMATE.  Because the heuristic
+  // is consistent, estimates never decrease as the search goes on,
+  // so we just work through the buckets in order.
+  //
+  unsigned base_estimate = heuristic (0, 0);
+  std::vector<std::vector<uint64_t> > buckets (1);
+  buckets[0].push_back (key (0, 0));
+  nodes[key (0, 0)] = Node { 0, false };
+
+  auto reach = [&] (unsigned to_idx, unsigned from_idx, unsigned cost)
+    {
+      uint64_t node_key = key (to_idx, from_idx);
+      auto inserted = nodes.emplace (node_key, Node { cost, false });
+      Node &node = inserted.first->second;
+      if (! inserted.second)
+	{
+	  if (node.closed || node.cost <= cost)
+	    return;
+	  node.cost = cost;
+	}
+      unsigned bucket = cost + heuristic (to_idx, from_idx) - base_estimate;
+      if (bucket >= buckets.size ())
+	buckets.resize (bucket + 1);
+      buckets[bucket].push_back (node_key);
+    };
+
+  // Expand entries until we reach the end.  Then carry on until the
+  // bucket holding the end is empty, so that every entry on any
+  // optimal path has its final cost; that lets us replay the path
+  // breaking ties the same way as compute_optimal_edits.
+  //
+  unsigned final_bucket = unreachable;
+  for (unsigned bucket = 0; bucket < buckets.size () && bucket <= final_bucket; bucket++)
+    while (! buckets[bucket].empty ())
+      {
+	uint64_t node_key = buckets[bucket].back ();
+	buckets[bucket].pop_back ();
+
+	Node &node = nodes[node_key];
+	if (node.closed)
+	  continue;
+	node.closed = true;
+
+	unsigned to_idx = node_key / (from_length + 1);
+	unsigned from_idx = node_key % (from_length + 1);
+	unsigned cost = node.cost;
+	if (to_idx == to_length && from_idx == from_length)
+	  {
+	    final_bucket = bucket;
+	    continue;
+	  }
+
+	if (to_idx < to_length)
+	  reach (to_idx + 1, from_idx, cost + costs[INSERT]);
+	if (from_idx < from_length)
+	  reach (to_idx, from_idx + 1, cost + costs[DELETE]);
+	if (to_idx < to_length && from_idx < from_length)
+	  reach (to_idx + 1, from_idx + 1, cost + costs[from[from_idx] == to[to_idx] ? SKIP : REPLACE]);
+	if (transpose && to_idx + 1 < to_length && from_idx + 1 < from_length
+	    && from[from_idx] == to[to_idx + 1] && from[from_idx + 1] == to[to_idx]
+	    && from[from_idx + 1] != to[to_idx + 1])
+	  reach (to_idx + 2, from_idx + 2, cost + costs[TRANSPOSE]);
+      }
+
+  // Replay the optimal path, choosing the predecessor of each entry
+  // exactly as fill_edit_row would have.
+  //
+  auto cost_at = [&] (unsigned to_idx, unsigned from_idx)
+    {
+      auto node = nodes.find (key (to_idx, from_idx));
+      return (node == nodes.end () || ! node->second.closed) ? unreachable : node->second.cost;
+    };
+
+  std::list<Edit> result;
+  unsigned from_idx = from_length, to_idx = to_length;
+  while (from_idx > 0 || to_idx > 0)
+    {
+      EditType type;
+      if (to_idx == 0)
+	type = DELETE;
+      else if (from_idx == 0)
+	type = INSERT;
+      else
+	{
+	  EditType rep_type = (from[from_idx - 1] == to[to_idx - 1]) ? SKIP : REPLACE;
+
+	  unsigned ins_cost = cost_at (to_idx - 1, from_idx) + costs[INSERT];
+	  unsigned del_cost = cost_at (to_idx, from_idx - 1) + costs[DELETE];
+	  unsigned rep_cost = cost_at (to_idx - 1, from_idx - 1) + costs[rep_type];
+
+	  unsigned cost;
+	  if (ins_cost < del_cost && ins_cost < rep_cost)
+	    {
+	      cost = ins_cost;
+	      type = INSERT;
+	    }
+	  else if (del_cost < rep_cost)
+	    {
+	      cost = del_cost;
+	      type = DELETE;
+	    }
+	  else
+	    {
+	      cost = rep_cost;
+	      type = rep_type;
+	    }
+
+	  if (transpose && to_idx > 1 && from_idx > 1
+	      && from[from_idx - 2] == to[to_idx - 1] && from[from_idx - 1] == to[to_idx - 2]
+	      && from[from_idx - 1] != to[to_idx - 1]
+	      && cost_at (to_idx - 2, from_idx - 2) + costs[TRANSPOSE] < cost)
+	    type = TRANSPOSE;
+	}
+
+      result.push_front (step_back (type, from, to, to_idx, from_idx));
+    }
+
+  return result;
+}
+
+
+// Four Russians
+//
+// The differences between adjacent entries of the cost matrix only
+// take a small range of values, so a square block of the matrix is
+// completely determined by the differences along its top row and left
+// column, and by which of its FROM and TO characters are equal.  For
+// small ranges we can precompute the differences along the bottom row
+// and right column for every possible block, then fill the matrix a
+// whole block at a time with a single table lookup.
+//
+// Within a row, the difference between an entry and the one to its
+// left is at most DELETE, and at least min (SKIP, REPLACE) - INSERT;
+// similarly going down a column, at most INSERT and at least
+// min (SKIP, REPLACE) - DELETE.  Both ranges have the same size.
+//
+
+class FourRussiansTable
+{
+public:
+
+  // Return the (cached) table for COSTS, or null if the Four Russians
+  // method isn't applicable to them, because transpositions are
+  // allowed or the range of differences is too large to tabulate.
+  //
+  static std::shared_ptr<const FourRussiansTable> get (const EditCosts &costs);
+
+  // Return the block size that would be used for COSTS, or zero if
+  // the Four Russians method isn't applicable, without building the
+  // table.  If SCALED_COSTS or SCALE are non-null, set them to the
+  // table's costs and scale.
+  //
+  static unsigned block_size_for (const EditCosts &costs, EditCosts *scaled_costs = nullptr, unsigned *scale = nullptr);
+
+  // Return roughly how many cost matrix entries' worth of work it
+  // would take to build the table for COSTS, or zero if it's already
+  // cached (or not applicable).
+  //
+  static double build_work (const EditCosts &costs);
+
+  // The width and height of a block.
+  //
+  unsigned block_size;
+
+  // The number of possible differences between adjacent entries, and
+  // the number of vectors of BLOCK_SIZE of them.
+  //
+  unsigned num_diffs, num_vectors;
+
+  // The smallest horizontal and vertical differences.
+  //
+  int min_horiz_diff, min_vert_diff;
+
+  // All the table's costs are divided by SCALE, the GCD of the
+  // original costs, to keep the range of differences down.
+  //
+  EditCosts costs;
+  unsigned scale;
+
+  // For each combination of equality pattern (one bit per pair of
+  // characters, row-major), top row differences and left column
+  // differences, the resulting bottom row and right column
+  // differences, encoded as BOTTOM * NUM_VECTORS + RIGHT.  A vector of
+  // differences is encoded as base-NUM_DIFFS digits, first entry
+  // least significant.
+  //
+  std::vector<uint32_t> entries;
+
+  // The sum of the differences in each horizontal vector.
+  //
+  std::vector<int> horiz_sums;
+
+  unsigned index (unsigned pattern, unsigned top, unsigned left) const
+  {
+    return (pattern * num_vectors + top) * num_vectors + left;
+  }
+
+  // Return the vector with every difference being DIFF.
+  //
+  unsigned uniform_vector (int diff) const
+  {
+    unsigned vec = 0;
+    for (unsigned pos = 0; pos < block_size; pos++)
+      vec = vec * num_diffs + diff;
+    return vec;
+  }
+
+private:
+
+  FourRussiansTable (const EditCosts &costs, unsigned block_size);
+
+  // The largest table we're willing to build.
+  //
+  static const unsigned max_entries = 1 << 20;
+
+  // The number of tables kept in the cache.
+  //
+  static const unsigned max_cached_tables = 8;
+
+  // Tables are built without holding the mutex, so that callers
+  // wanting other tables aren't held up, and each entry's table is a
+  // future, which is ready once it's built.  USE_COUNT is the value
+  // of the cache's counter when an entry was last used, for evicting
+  // the least recently used one, and BUILD identifies the build that
+  // made it.
+  //
+  struct CacheEntry
+  {
+    std::shared_future<std::shared_ptr<const FourRussiansTable> > table;
+    uint64_t use_count, build;
+  };
+
+  struct Cache
+  {
+    std::mutex mutex;
+    std::map<EditCosts, CacheEntry> tables;
+    uint64_t use_count = 0, builds = 0;
+  };
+  static Cache &cache ();
+};
+
+FourRussiansTable::FourRussiansTable (const EditCosts &_costs, unsigned _block_size)
+  : block_size (_block_size), costs (_costs)
+{
+  unsigned diag_cost = std::min (costs[SKIP], costs[REPLACE]);
+  min_horiz_diff = int (diag_cost) - int (costs[INSERT]);
+  min_vert_diff = int (diag_cost) - int (costs[DELETE]);
+  num_diffs = costs[DELETE] - min_horiz_diff + 1;
+  num_vectors = 1;
+  for (unsigned pos = 0; pos < block_size; pos++)
+    num_vectors *= num_diffs;
+
+  horiz_sums.resize (num_vectors);
+  for (unsigned vec = 0; vec < num_vectors; vec++)
+    for (unsigned pos = 0, rest = vec; pos < block_size; pos++, rest /= num_diffs)
+      horiz_sums[vec] += min_horiz_diff + int (rest % num_diffs);
+
+  // Fill in each entry by computing the block the slow way, with the
+  // top-left corner's cost taken to be zero.  Some combinations of
+  // inputs can never actually occur, so their outputs are clamped to
+  // the valid range; they'll never be used anyway.
+  //
+  unsigned side = block_size + 1;
+  std::vector<int> block (side * side);
+  unsigned num_patterns = 1 << (block_size * block_size);
+  entries.resize (size_t (num_patterns) * num_vectors * num_vectors);
+  for (unsigned pattern = 0; pattern < num_patterns; pattern++)
+    for (unsigned top = 0; top < num_vectors; top++)
+      for (unsigned left = 0; left < num_vectors; left++)
+	{
+	  block[0] = 0;
+	  for (unsigned pos = 0, top_rest = top, left_rest = left; pos < block_size;
+	       pos++, top_rest /= num_diffs, left_rest /= num_diffs)
+	    {
+	      block[pos + 1] = block[pos] + min_horiz_diff + int (top_rest % num_diffs);
+	      block[(pos + 1) * side] = block[pos * side] + min_vert_diff + int (left_rest % num_diffs);
+	    }
+
+	  for (unsigned row = 1; row < side; row++)
+	    for (unsigned col = 1; col < side; col++)
+	      {
+		bool equal = pattern & (1 << ((row - 1) * block_size + col - 1));
+		block[row * side + col]
+		  = std::min ({ block[(row - 1) * side + col] + int (costs[INSERT]),
+				block[row * side + col - 1] + int (costs[DELETE]),
+				block[(row - 1) * side + col - 1] + int (costs[equal ? SKIP : REPLACE]) });
+	      }
+
+	  auto digit = [&] (int diff, int min_diff)
+	    {
+	      return unsigned (std::max (0, std::min (int (num_diffs) - 1, diff - min_diff)));
+	    };
+	  unsigned bottom = 0, right = 0;
+	  for (unsigned pos = block_size; pos > 0; pos--)
+	    {
+	      bottom = bottom * num_diffs
+		+ digit (block[block_size * side + pos] - block[block_size * side + pos - 1], min_horiz_diff);
+	      right = right * num_diffs
+		+ digit (block[pos * side + block_size] - block[(pos - 1) * side + block_size], min_vert_diff);
+	    }
+
+	  entries[index (pattern, top, left)] = bottom * num_vectors + right;
+	}
+}
+
+unsigned
+FourRussiansTable::block_size_for (const EditCosts &costs, EditCosts *scaled_costs, unsigned *scale)
+{
+  unsigned gcd = 0;
+  for (unsigned cost : { costs[SKIP], costs[DELETE], costs[INSERT], costs[REPLACE] })
+    {
+      unsigned a = gcd, b = cost;
+      while (b != 0)
+	{
+	  unsigned rem = a % b;
+	  a = b;
+	  b = rem;
+	}
+      gcd = a;
+    }
+
+  unsigned diag_cost = std::min (costs[SKIP], costs[REPLACE]);
+  if (costs[TRANSPOSE] != DISALLOWED || gcd == 0 || diag_cost > costs[DELETE] + costs[INSERT])
+    return 0;
+
+  uint64_t num_diffs = (costs[DELETE] + costs[INSERT] - diag_cost) / gcd + 1;
+
+  // Use the biggest blocks that give a reasonably sized table;
+  // blocks of one entry would gain nothing.
+  //
+  unsigned block_size = 0;
+  for (unsigned size = 2; size <= 4; size++)
+    {
+      uint64_t num_entries = uint64_t (1) << (size * size);
+      for (unsigned pos = 0; pos < 2 * size && num_entries <= max_entries; pos++)
+	num_entries *= num_diffs;
+      if (num_entries <= max_entries)
+	block_size = size;
+    }
+
+  if (scaled_costs)
+    {
+      *scaled_costs = costs;
+      for (unsigned &cost : *scaled_costs)
+	if (cost != DISALLOWED)
+	  cost /= gcd;
+    }
+  if (scale)
+    *scale = gcd;
+
+  return block_size;
+}
+
+FourRussiansTable::Cache &
+FourRussiansTable::cache ()
+{
+  static Cache cache;
+  return cache;
+}
+
+double
+FourRussiansTable::build_work (const EditCosts &costs)
+{
+  unsigned block_size = block_size_for (costs);
+  if (block_size == 0)
+    return 0;
+
+  {
+    std::lock_guard<std::mutex> lock (cache ().mutex);
+    if (cache ().tables.count (costs))
+      return 0;
+  }
+
+  EditCosts scaled_costs;
+  block_size_for (costs, &scaled_costs);
+  double num_entries = double (1 << (block_size * block_size));
+  double num_diffs = scaled_costs[DELETE] + scaled_costs[INSERT] - std::min (scaled_costs[SKIP], scaled_costs[REPLACE]) + 1;
+  for (unsigned pos = 0; pos < 2 * block_size; pos++)
+    num_entries *= num_diffs;
+  return num_entries * block_size * block_size;
+}
+
+std::shared_ptr<const FourRussiansTable>
+FourRussiansTable::get (const EditCosts &costs)
+{
+  Cache &cache = FourRussiansTable::cache ();
+  std::promise<std::shared_ptr<const FourRussiansTable> > promise;
+  std::shared_future<std::shared_ptr<const FourRussiansTable> > future;
+  uint64_t build = 0;
+  {
+    std::lock_guard<std::mutex> lock (cache.mutex);
+    auto cached = cache.tables.find (costs);
+    if (cached != cache.tables.end ())
+      {
+	cached->second.use_count = ++cache.use_count;
+	future = cached->second.table;
+      }
+    else
+      {
+	// Tables can be several megabytes, so only a few cost
+	// configurations are kept; callers still using a discarded
+	// table keep it alive through their own reference.
+	//
+	if (cache.tables.size () >= max_cached_tables)
+	  cache.tables.erase (std::min_element (cache.tables.begin (), cache.tables.end (),
+						[] (const std::pair<const EditCosts, CacheEntry> &a,
+						    const std::pair<const EditCosts, CacheEntry> &b)
+						{ return a.second.use_count < b.second.use_count; }));
+	build = ++cache.builds;
+	future = promise.get_future ().share ();
+	cache.tables[costs] = CacheEntry { future, ++cache.use_count, build };
+      }
+  }
+
+  // If it's up to us to build the table, anyone else wanting it waits
+  // on the future meanwhile.  A failed build isn't kept, so the next
+  // caller tries again.
+  //
+  if (build != 0)
+    try
+      {
+	std::shared_ptr<const FourRussiansTable> table;
+	EditCosts scaled_costs;
+	unsigned scale;
+	unsigned block_size = block_size_for (costs, &scaled_costs, &scale);
+	if (block_size != 0)
+	  {
+	    FourRussiansTable *new_table = new FourRussiansTable (scaled_costs, block_size);
+	    new_table->scale = scale;
+	    table.reset (new_table);
+	  }
+	promise.set_value (table);
+      }
+    catch (...)
+      {
+	promise.set_exception (std::current_exception ());
+	std::lock_guard<std::mutex> lock (cache.mutex);
+	auto cached = cache.tables.find (costs);
+	if (cached != cache.tables.end () && cached->second.build == build)
+	  cache.tables.erase (cached);
+      }
+
+  return future.get ();
+}
+
+// Compute the same optimal edits as compute_optimal_edits using the
+// Four Russians method, if it's applicable to COSTS.
+//
+// We only keep the encoded outputs of each block, and the costs at
+// their corners.  To replay the optimal path, we recompute each block
+// it passes through the slow way, from its boundaries, which gives
+// exactly the same choices as the full computation would.
+//
+std::list<Edit>
+compute_four_russians_edits (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  std::shared_ptr<const FourRussiansTable> table = FourRussiansTable::get (costs);
+  if (! table || from.empty () || to.empty ())
+    return compute_optimal_edits (from, to, costs);
+
+  const EditCosts &scaled_costs = table->costs;
+  unsigned block_size = table->block_size;
+  unsigned num_vectors = table->num_vectors;
+  unsigned from_length = from.length (), to_length = to.length ();
+  unsigned from_blocks = (from_length + block_size - 1) / block_size;
+  unsigned to_blocks = (to_length + block_size - 1) / block_size;
+
+  // Encode each block's worth of characters using a compact alphabet,
+  // so that for small alphabets we can look up the equality pattern
+  // for a block rather than having to compare every pair of
+  // characters.  The ends of the strings are padded with two extra
+  // characters, which don't match each other or anything else.
+  //
+  std::array<unsigned, 256> char_codes;
+  char_codes.fill (0);
+  unsigned alphabet_size = 0;
+  for (const std::string *str : { &from, &to })
+    for (char ch : *str)
+      if (char_codes[uchar (ch)] == 0)
+	char_codes[uchar (ch)] = ++alphabet_size;
+  unsigned from_pad = 0, to_pad = ++alphabet_size;
+  alphabet_size++;
+
+  auto char_code = [&] (const std::string &str, unsigned idx, unsigned pad)
+    {
+      return (idx < str.length ()) ? char_codes[uchar (str[idx])] : pad;
+    };
+  auto chunk_codes = [&] (const std::string &str, unsigned num_blocks, unsigned pad)
+    {
+      std::vector<unsigned> codes (num_blocks);
+      for (unsigned blk = 0; blk < num_blocks; blk++)
+	for (unsigned pos = block_size; pos > 0; pos--)
+	  codes[blk] = codes[blk] * alphabet_size + char_code (str, blk * block_size + pos - 1, pad);
+      return codes;
+    };
+  std::vector<unsigned> from_chunks = chunk_codes (from, from_blocks, from_pad);
+  std::vector<unsigned> to_chunks = chunk_codes (to, to_blocks, to_pad);
+
+  unsigned num_chunks = 1;
+  for (unsigned pos = 0; pos < block_size; pos++)
+    num_chunks *= alphabet_size;
+
+  auto compute_pattern = [&] (unsigned to_chunk, unsigned from_chunk)
+    {
+      unsigned pattern = 0;
+      for (unsigned row = 0, to_rest = to_chunk; row < block_size; row++, to_rest /= alphabet_size)
+	for (unsigned col = 0, from_rest = from_chunk; col < block_size; col++, from_rest /= alphabet_size)
+	  if (to_rest % alphabet_size == from_rest % alphabet_size)
+	    pattern |= 1 << (row * block_size + col);
+      return pattern;
+    };
+
+  std::vector<uint16_t> patterns;
+  if (uint64_t (num_chunks) * num_chunks <= (1 << 16))
+    {
+      patterns.resize (num_chunks * num_chunks);
+      for (unsigned to_chunk = 0; to_chunk < num_chunks; to_chunk++)
+	for (unsigned from_chunk = 0; from_chunk < num_chunks; from_chunk++)
+	  patterns[to_chunk * num_chunks + from_chunk] = compute_pattern (to_chunk, from_chunk);
+    }
+
+  // Fill in the matrix a block at a time, remembering the output of
+  // each block and the cost at each block corner.
+  //
+  size_t corner_row_length = from_blocks + 1;
+  std::vector<uint32_t> block_outputs (size_t (to_blocks) * from_blocks);
+  std::vector<unsigned> corners ((to_blocks + 1) * corner_row_length);
+
+  unsigned first_top = table->uniform_vector (scaled_costs[DELETE] - table->min_horiz_diff);
+  unsigned first_left = table->uniform_vector (scaled_costs[INSERT] - table->min_vert_diff);
+  std::vector<unsigned> tops (from_blocks, first_top);
+
+  for (unsigned from_blk = 0; from_blk <= from_blocks; from_blk++)
+    corners[from_blk] = from_blk * block_size * scaled_costs[DELETE];
+
+  for (unsigned to_blk = 0; to_blk < to_blocks; to_blk++)
+    {
+      unsigned to_chunk = to_chunks[to_blk];
+      unsigned left = first_left;
+      unsigned *corner_row = &corners[(to_blk + 1) * corner_row_length];
+      corner_row[0] = (to_blk + 1) * block_size * scaled_costs[INSERT];
+
+      for (unsigned from_blk = 0; from_blk < from_blocks; from_blk++)
+	{
+	  unsigned from_chunk = from_chunks[from_blk];
+	  unsigned pattern = patterns.empty ()
+	    ? compute_pattern (to_chunk, from_chunk) : patterns[to_chunk * num_chunks + from_chunk];
+
+	  uint32_t output = table->entries[table->index (pattern, tops[from_blk], left)];
+	  block_outputs[to_blk * size_t (from_blocks) + from_blk] = output;
+
+	  tops[from_blk] = output / num_vectors;
+	  left = output % num_vectors;
+	  corner_row[from_blk + 1] = corner_row[from_blk] + table->horiz_sums[tops[from_blk]];
+	}
+    }
+
+  // Replay the optimal path, recomputing blocks as we enter them.
+  //
+  unsigned side = block_size + 1;
+  std::vector<unsigned> block_costs (side * side);
+  std::vector<unsigned char> block_trace (side * side);
+  unsigned cur_to_blk = to_blocks, cur_from_blk = from_blocks;
+
+  auto recompute_block = [&] (unsigned to_blk, unsigned from_blk)
+    {
+      unsigned top = (to_blk == 0) ? first_top : block_outputs[(to_blk - 1) * size_t (from_blocks) + from_blk] / num_vectors;
+      unsigned left = (from_blk == 0) ? first_left : block_outputs[to_blk * size_t (from_blocks) + from_blk - 1] % num_vectors;
+
+      block_costs[0] = corners[to_blk * corner_row_length + from_blk];
+      for (unsigned pos = 0; pos < block_size; pos++, top /= table->num_diffs, left /= table->num_diffs)
+	{
+	  block_costs[pos + 1] = block_costs[pos] + table->min_horiz_diff + int (top % table->num_diffs);
+	  block_costs[(pos + 1) * side] = block_costs[pos * side] + table->min_vert_diff + int (left % table->num_diffs);
+	}
+
+      for (unsigned row = 1; row < side; row++)
+	for (unsigned col = 1; col < side; col++)
+	  {
+	    unsigned to_idx = to_blk * block_size + row - 1;
+	    unsigned from_idx = from_blk * block_size + col - 1;
+	    if (to_idx >= to_length || from_idx >= from_length)
+	      continue;
+
+	    EditType rep_type = (from[from_idx] == to[to_idx]) ? SKIP : REPLACE;
+
+	    unsigned ins_cost = block_costs[(row - 1) * side + col] + scaled_costs[INSERT];
+	    unsigned del_cost = block_costs[row * side + col - 1] + scaled_costs[DELETE];
+	    unsigned rep_cost = block_costs[(row - 1) * side + col - 1] + scaled_costs[rep_type];
+
+	    unsigned cost;
+	    EditType type;
+	    if (ins_cost < del_cost && ins_cost < rep_cost)
+	      {
+		cost = ins_cost;
+		type = INSERT;
+	      }
+	    else if (del_cost < rep_cost)
+	      {
+		cost = del_cost;
+		type = DELETE;
+	      }
+	    else
+	      {
+		cost = rep_cost;
+		type = rep_type;
+	      }
+
+	    block_costs[row * side + col] = cost;
+	    block_trace[row * side + col] = type;
+	  }
+
+      cur_to_blk = to_blk;
+      cur_from_blk = from_blk;
+    };
+
+  std::list<Edit> result;
+  unsigned from_idx = from_length, to_idx = to_length;
+  while (from_idx > 0 || to_idx > 0)
+    {
+      EditType type;
+      if (to_idx == 0)
+	type = DELETE;
+      else if (from_idx == 0)
+	type = INSERT;
+      else
+	{
+	  unsigned to_blk = (to_idx - 1) / block_size, from_blk = (from_idx - 1) / block_size;
+	  if (to_blk != cur_to_blk || from_blk != cur_from_blk)
+	    recompute_block (to_blk, from_blk);
+	  type = EditType (block_trace[(to_idx - to_blk * block_size) * side + from_idx - from_blk * block_size]);
+	}
+
+      result.push_front (step_back (type, from, to, to_idx, from_idx));
+    }
+
+  return result;
+}
+
+
+// Checkpointed traceback
+//
+// Keeping the edit for every entry of the matrix takes
+// O(FROM_LENGTH * TO_LENGTH) memory.  Instead we can keep just the
+// cost rows at regular checkpoints while filling in the matrix, then
+// during the replay recompute the edits for each segment of rows
+// between checkpoints when the path enters it.  This does roughly
+// twice as much computation, but with checkpoints every
+// O(sqrt (TO_LENGTH)) rows only needs O(FROM_LENGTH * sqrt (TO_LENGTH))
+// memory.
+//
+
+// Return the number of bytes compute_checkpointed_edits needs with
+// checkpoints every INTERVAL rows.
+//
+size_t
+checkpointed_edits_memory (unsigned from_length, unsigned to_length, bool transpose, unsigned interval)
+{
+  size_t row_length = from_length + 1;
+  size_t num_checkpoints = (to_length + interval - 1) / interval;
+  return num_checkpoints * row_length * sizeof (unsigned) * (transpose ? 2 : 1) + interval * row_length;
+}
+
+// Return the checkpoint interval to use for strings of the given
+// lengths so as to fit in MEMORY_BUDGET bytes, or to use as little
+// memory as possible if MEMORY_BUDGET is zero (or too small).
+//
+// The trace of the last segment is left over from filling in the
+// matrix, and every other segment is recomputed, so the longer the
+// interval the less recomputation there is; we use the longest that
+// fits.
+//
+unsigned
+checkpoint_interval (unsigned from_length, unsigned to_length, bool transpose, size_t memory_budget)
+{
+  if (to_length == 0)
+    return 1;
+
+  unsigned checkpoint_rows = transpose ? 2 : 1;
+  unsigned interval = std::max (1.0, std::round (std::sqrt (double (to_length) * sizeof (unsigned) * checkpoint_rows)));
+  interval = std::min (interval, to_length);
+
+  if (memory_budget != 0
+      && checkpointed_edits_memory (from_length, to_length, transpose, interval) <= memory_budget)
+    {
+      unsigned longest = to_length;
+      while (interval < longest)
+	{
+	  unsigned mid = interval + (longest - interval + 1) / 2;
+	  if (checkpointed_edits_memory (from_length, to_length, transpose, mid) <= memory_budget)
+	    interval = mid;
+	  else
+	    longest = mid - 1;
+	}
+    }
+
+  return interval;
+}
+
+template<class Costs>
+std::list<Edit>
+compute_checkpointed_edits_with (const std::string &from, const std::string &to, Costs &costs, size_t memory_budget)
+{
+  unsigned from_length = from.length ();
+  unsigned to_length = to.length ();
+  size_t row_length = from_length + 1;
+  bool transpose = (costs.transpose_cost () != DISALLOWED);
+  unsigned interval = checkpoint_interval (from_length, to_length, transpose, memory_budget);
+
+  // Segment SEG covers rows SEG * INTERVAL + 1 up to (SEG + 1) *
+  // INTERVAL, and its checkpoint holds row SEG * INTERVAL (and the
+  // one before, for transpositions).  TRACE holds the edits for the
+  // rows of one segment.
+  //
+  unsigned num_segments = (to_length + interval - 1) / interval;
+  std::vector<std::vector<unsigned> > checkpoints (num_segments), prev_checkpoints (transpose ? num_segments : 0);
+  std::vector<unsigned char> trace (interval * row_length), first_trace (row_length);
+  std::vector<unsigned> prev2_row (row_length), prev_row (row_length), row (row_length);
+
+  auto save_checkpoint = [&] (unsigned seg)
+    {
+      checkpoints[seg] = prev_row;
+      if (transpose)
+	prev_checkpoints[seg] = prev2_row;
+    };
+  auto trace_row = [&] (unsigned to_idx) { return &trace[(to_idx % interval) * row_length]; };
+
+  fill_first_edit_row (from, costs, prev_row.data (), first_trace.data ());
+  if (num_segments > 0)
+    save_checkpoint (0);
+
+  fill_edit_rows (from, to, costs, 0, to_length, prev2_row, prev_row, row, trace_row,
+		  [&] (unsigned to_idx)
+		  {
+		    unsigned rows_done = to_idx + 1;
+		    if (rows_done % interval == 0 && rows_done / interval < num_segments)
+		      save_checkpoint (rows_done / interval);
+		  });
+
+  // Replay the optimal path, recomputing each segment's edits from its
+  // checkpoint when the path enters it.  The last segment's edits are
+  // still in TRACE.
+  //
+  std::list<Edit> result;
+  unsigned from_idx = from_length, to_idx = to_length;
+  unsigned cur_seg = num_segments - 1;
+  while (from_idx > 0 || to_idx > 0)
+    {
+      EditType type;
+      if (to_idx == 0)
+	type = DELETE;
+      else
+	{
+	  unsigned seg = (to_idx - 1) / interval;
+	  if (seg != cur_seg)
+	    {
+	      std::swap (prev_row, checkpoints[seg]);
+	      if (transpose)
+		std::swap (prev2_row, prev_checkpoints[seg]);
+	      checkpoints[seg].clear ();
+	      checkpoints[seg].shrink_to_fit ();
+
+	      fill_edit_rows (from, to, costs, seg * interval, std::min ((seg + 1) * interval, to_length),
+			      prev2_row, prev_row, row, trace_row, [] (unsigned) { });
+	      cur_seg = seg;
+	    }
+	  type = EditType (trace_row (to_idx - 1)[from_idx]);
+	}
+
+      result.push_front (step_back (type, from, to, to_idx, from_idx));
+    }
+
+  return result;
+}
+
+// Compute the same optimal edits as compute_optimal_edits, using
+// checkpoints to reduce memory use.  If MEMORY_BUDGET is non-zero,
+// checkpoints are spaced as far apart as it allows.
+//
+std::list<Edit>
+compute_checkpointed_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+			    size_t memory_budget = 0)
+{
+  UniformCosts uniform_costs (costs, from);
+  return compute_checkpointed_edits_with (from, to, uniform_costs, memory_budget);
+}
+
+std::list<Edit>
+compute_checkpointed_edits (const std::string &from, const std::string &to, const CostTable &costs,
+			    size_t memory_budget = 0)
+{
+  TableCosts table_costs (costs, from);
+  return compute_checkpointed_edits_with (from, to, table_costs, memory_budget);
+}
+
+
+// Out-of-core traceback
+//
+// For very long strings even a byte per matrix entry is too much to
+// keep in memory, so this keeps the edits in a temporary file instead,
+// packed four entries per byte, as without transpositions the edit
+// types fit in two bits, or two entries per byte with them.  The rows are grouped into tiles, each
+// of which is memory-mapped in turn: while filling in the matrix, the
+// tiles are written strictly in order and handed to the kernel for
+// write-back as each is finished, and during the replay they're mapped
+// again in reverse order.  Only one tile is mapped at a time, so the
+// memory used is bounded by the tile size rather than the matrix.
+//
+
+class TraceFile
+{
+public:
+
+  // Create an anonymous temporary file in DIR (or $TMPDIR, or /tmp,
+  // if DIR is empty) big enough for the edits of a matrix with the
+  // given dimensions, using tiles of about TILE_BYTES.  Row 0, which
+  // is all deletions, isn't stored.  Entries take four bits if
+  // TRANSPOSE, and two otherwise.
+  //
+  TraceFile (unsigned from_length, unsigned to_length, bool transpose, const std::string &dir,
+	     size_t tile_bytes)
+    : _entry_bits (transpose ? 4 : 2), _row_bytes (row_bytes (from_length, transpose))
+  {
+    std::string path = dir;
+    if (path.empty ())
+      {
+	const char *tmpdir = getenv ("TMPDIR");
+	path = (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+      }
+    path += "/optedit-trace-XXXXXX";
+
+    _fd = mkstemp (&path[0]);
+    if (_fd < 0)
+      throw std::system_error (errno, std::generic_category (), "creating " + path);
+    unlink (path.c_str ());
+
+    size_t page_size = sysconf (_SC_PAGESIZE);
+    _tile_rows = std::max<size_t> (1, tile_bytes / _row_bytes);
+    _tile_bytes = (_tile_rows * _row_bytes + page_size - 1) / page_size * page_size;
+
+    size_t num_tiles = (to_length + _tile_rows - 1) / _tile_rows;
+    if (ftruncate (_fd, off_t (num_tiles * _tile_bytes)) != 0)
+      {
+	int err = errno;
+	close (_fd);
+	throw std::system_error (err, std::generic_category (), "extending traceback file");
+      }
+  }
+
+  ~TraceFile ()
+  {
+    unmap ();
+    close (_fd);
+  }
+
+  TraceFile (const TraceFile &) = delete;
+  TraceFile &operator= (const TraceFile &) = delete;
+
+  // The bytes needed for each row of a matrix with FROM_LENGTH.
+  //
+  static size_t row_bytes (unsigned from_length, bool transpose)
+  {
+    unsigned per_byte = transpose ? 2 : 4;
+    return (size_t (from_length) + per_byte) / per_byte;
+  }
+
+  // Return the packed storage for row ROW (which must be at least 1),
+  // mapping its tile for writing or reading as required.
+  //
+  unsigned char *write_row (unsigned row) { return row_ptr (row, true); }
+  const unsigned char *read_row (unsigned row) { return row_ptr (row, false); }
+
+  // Pack the one-byte-per-entry ROW_LENGTH entries in TRACE into
+  // PACKED, and the reverse for a single entry.
+  //
+  void pack (const unsigned char *trace, size_t row_length, unsigned char *packed) const
+  {
+    unsigned per_byte = 8 / _entry_bits;
+    for (size_t idx = 0; idx < row_length; idx += per_byte)
+      {
+	unsigned char byte = 0;
+	for (unsigned sub = 0; sub < per_byte && idx + sub < row_length; sub++)
+	  byte |= trace[idx + sub] << (sub * _entry_bits);
+	packed[idx / per_byte] = byte;
+      }
+  }
+  EditType unpack (const unsigned char *packed, size_t idx) const
+  {
+    unsigned per_byte = 8 / _entry_bits;
+    return EditType ((packed[idx / per_byte] >> (idx % per_byte * _entry_bits)) & ((1 << _entry_bits) - 1));
+  }
+
+private:
+
+  unsigned char *row_ptr (unsigned row, bool write)
+  {
+    size_t tile = (row - 1) / _tile_rows;
+    if (! _map || tile != _mapped_tile || write != _mapped_for_write)
+      map_tile (tile, write);
+    return _map + ((row - 1) % _tile_rows) * _row_bytes;
+  }
+
+  void map_tile (size_t tile, bool write)
+  {
+    unmap ();
+
+    void *map = mmap (nullptr, _tile_bytes, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+		      _fd, off_t (tile * _tile_bytes));
+    if (map == MAP_FAILED)
+      throw std::system_error (errno, std::generic_category (), "mapping traceback file");
+
+    // Tiles are written sequentially, but the replay goes backwards
+    // and only touches a few entries in each row, so readahead would
+    // just be wasted.
+    //
+    madvise (map, _tile_bytes, write ? MADV_SEQUENTIAL : MADV_RANDOM);
+
+    _map = static_cast<unsigned char *> (map);
+    _mapped_tile = tile;
+    _mapped_for_write = write;
+  }
+
+  void unmap ()
+  {
+    if (_map)
+      {
+	// Start writing back a finished tile now, rather than leaving
+	// the kernel to find lots of dirty pages later.
+	//
+	if (_mapped_for_write)
+	  msync (_map, _tile_bytes, MS_ASYNC);
+	munmap (_map, _tile_bytes);
+	_map = nullptr;
+      }
+  }
+
+  int _fd;
+  unsigned _entry_bits;
+  size_t _row_bytes, _tile_rows, _tile_bytes;
+  unsigned char *_map = nullptr;
+  size_t _mapped_tile = 0;
+  bool _mapped_for_write = false;
+};
+
+// The default tile size for out-of-core tracebacks.
+//
+const size_t default_trace_tile_bytes = 64 << 20;
+
+template<class Costs>
+std::list<Edit>
+compute_out_of_core_edits_with (const std::string &from, const std::string &to, Costs &costs,
+				const std::string &temp_dir, size_t tile_bytes)
+{
+  unsigned from_length = from.length ();
+  unsigned to_length = to.length ();
+  size_t row_length = from_length + 1;
+
+  TraceFile trace_file (from_length, to_length, costs.transpose_cost () != DISALLOWED, temp_dir, tile_bytes);
+
+  std::vector<unsigned char> trace_row (row_length);
+  std::vector<unsigned> prev2_row (row_length), prev_row (row_length), row (row_length);
+
+  fill_first_edit_row (from, costs, prev_row.data (), trace_row.data ());
+  fill_edit_rows (from, to, costs, 0, to_length, prev2_row, prev_row, row,
+		  [&] (unsigned) { return trace_row.data (); },
+		  [&] (unsigned to_idx)
+		  {
+		    trace_file.pack (trace_row.data (), row_length, trace_file.write_row (to_idx + 1));
+		  });
+
+  std::list<Edit> result;
+  unsigned from_idx = from_length, to_idx = to_length;
+  while (from_idx > 0 || to_idx > 0)
+    {
+      EditType type = (to_idx == 0) ? DELETE : trace_file.unpack (trace_file.read_row (to_idx), from_idx);
+      result.push_front (step_back (type, from, to, to_idx, from_idx));
+    }
+
+  return result;
+}
+
+// Compute the same optimal edits as compute_optimal_edits, keeping the
+// traceback in a temporary file in TEMP_DIR (by default, $TMPDIR or
+// /tmp).  Throws std::system_error if the file can't be created or
+// mapped.
+//
+std::list<Edit>
+compute_out_of_core_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+			   const std::string &temp_dir = "", size_t tile_bytes = default_trace_tile_bytes)
+{
+  UniformCosts uniform_costs (costs, from);
+  return compute_out_of_core_edits_with (from, to, uniform_costs, temp_dir, tile_bytes);
+}
+
+std::list<Edit>
+compute_out_of_core_edits (const std::string &from, const std::string &to, const CostTable &costs,
+			   const std::string &temp_dir = "", size_t tile_bytes = default_trace_tile_bytes)
+{
+  TableCosts table_costs (costs, from);
+  return compute_out_of_core_edits_with (from, to, table_costs, temp_dir, tile_bytes);
+}
+
+
+// Planning
+//
+// Each of the engines above has different time and memory
+// requirements, depending on the string lengths, the costs, and how
+// far apart the strings are allowed to be.  plan_edits chooses between
+// them, and records its reasoning so callers can see why a particular
+// computation was slow or used a lot of memory.
+//
+
+enum EditStrategy { FULL_MATRIX, CHECKPOINTED, FOUR_RUSSIANS, BANDED, WAVEFRONT, OUT_OF_CORE };
+const char *edit_strategy_names[6] = { "full-matrix", "checkpointed", "four-russians", "banded", "wavefront", "out-of-core" };
+
+// What plan_edits thought a strategy would cost.  WORK is roughly in
+// units of cost matrix entries computed.
+//
+struct StrategyEstimate
+{
+  EditStrategy strategy;
+  size_t memory;
+  double work;
+};
+
+struct EditPlan
+{
+  EditStrategy strategy;
+
+  // The request.  A MEMORY_BUDGET of zero means no limit, and a
+  // MAX_COST of DISALLOWED means no bound.  ALLOW_DISK says whether
+  // temporary files may be used, and ANY_OPTIMAL whether any optimal
+  // edits will do, rather than just those compute_optimal_edits
+  // returns.
+  //
+  unsigned from_length, to_length;
+  size_t memory_budget;
+  unsigned max_cost;
+  bool allow_disk, any_optimal;
+
+  // The estimates for every applicable strategy, in order of
+  // consideration, and why STRATEGY was chosen from them.
+  //
+  std::vector<StrategyEstimate> estimates;
+  std::string reason;
+};
+
+// Choose a strategy for computing the edits between strings of length
+// FROM_LENGTH and TO_LENGTH with COSTS, using at most MEMORY_BUDGET
+// bytes (if non-zero), when only results costing at most MAX_COST (if
+// not DISALLOWED) are of interest.
+//
+// The band and wavefront engines need a cost bound to be predictable,
+// so they're only considered when one is given, and the out-of-core
+// engine only if ALLOW_DISK is true.  Of the strategies that fit in
+// the budget, the one with the least estimated work wins; if none
+// fit, the one using the least memory.
+//
+// Every strategy returns the same edits as compute_optimal_edits,
+// except the wavefront engine, which may pick different ones where
+// there's a tie, so the result would depend on the budget.  It's only
+// considered if ANY_OPTIMAL is true.
+//
+EditPlan
+plan_edits (unsigned from_length, unsigned to_length, const EditCosts &costs,
+	    size_t memory_budget = 0, unsigned max_cost = DISALLOWED, bool allow_disk = false,
+	    bool any_optimal = false)
+{
+  EditPlan plan;
+  plan.from_length = from_length;
+  plan.to_length = to_length;
+  plan.memory_budget = memory_budget;
+  plan.max_cost = max_cost;
+  plan.allow_disk = allow_disk;
+  plan.any_optimal = any_optimal;
+
+  bool transpose = (costs[TRANSPOSE] != DISALLOWED);
+  size_t row_length = from_length + 1;
+  size_t row_bytes = row_length * sizeof (unsigned);
+  double entries = double (to_length + 1) * row_length;
+
+  plan.estimates.push_back ({ FULL_MATRIX, (to_length + 1) * row_length + 3 * row_bytes, entries });
+
+  unsigned interval = checkpoint_interval (from_length, to_length, transpose, memory_budget);
+  plan.estimates.push_back ({ CHECKPOINTED,
+			      checkpointed_edits_memory (from_length, to_length, transpose, interval) + 3 * row_bytes,
+			      entries * (2 - double (interval) / std::max (to_length, 1u)) });
+
+  if (unsigned block_size = FourRussiansTable::block_size_for (costs))
+    {
+      // A block lookup costs about as much as computing a couple of
+      // entries directly.  If the table hasn't been built yet, that
+      // has to be paid for too.
+      //
+      size_t blocks = size_t ((to_length + block_size - 1) / block_size + 1) * ((from_length + block_size - 1) / block_size + 1);
+      plan.estimates.push_back ({ FOUR_RUSSIANS, blocks * 2 * sizeof (unsigned),
+				  2 * entries / (block_size * block_size) + FourRussiansTable::build_work (costs) });
+    }
+
+  if (allow_disk)
+    {
+      // Only one tile is in memory at a time, but the page cache
+      // makes writing and rereading the file somewhat slower than
+      // keeping it in memory.
+      //
+      size_t tile_bytes = std::min<size_t> (default_trace_tile_bytes,
+					    (to_length + 1) * TraceFile::row_bytes (from_length, transpose));
+      if (memory_budget != 0)
+	tile_bytes = std::min (tile_bytes, memory_budget / 2);
+      plan.estimates.push_back ({ OUT_OF_CORE, tile_bytes + 4 * row_bytes, entries * 1.25 });
+    }
+
+  if (max_cost != DISALLOWED)
+    {
+      int lo, hi;
+      band_for_cost_bound (from_length, to_length, costs, max_cost, lo, hi);
+      size_t width = hi - lo + 1;
+      plan.estimates.push_back ({ BANDED, (to_length + 1) * width + 3 * (width + 1) * sizeof (unsigned),
+				  double (to_length + 1) * width });
+
+      // Wavefront I covers at most about 2 * I / GAP diagonals, where
+      // GAP is the smaller gap penalty, and we keep them all.
+      // Following matches adds up to FROM_LENGTH + TO_LENGTH more
+      // work.
+      //
+      WavefrontPenalties penalties;
+      if (any_optimal && get_wavefront_penalties (costs, penalties))
+	{
+	  int64_t max_doubled_cost = 2 * int64_t (max_cost) - int64_t (costs[SKIP]) * (from_length + to_length);
+	  double max_score = std::max<int64_t> (max_doubled_cost, 0) / penalties.scale;
+	  double gap = std::min (penalties.insert, penalties.del);
+	  double diagonals = std::min (max_score * max_score / gap + max_score + 1, entries);
+	  plan.estimates.push_back ({ WAVEFRONT, size_t (diagonals * sizeof (int)),
+				      diagonals + from_length + to_length });
+	}
+    }
+
+  const StrategyEstimate *best = nullptr;
+  for (const StrategyEstimate &estimate : plan.estimates)
+    if ((memory_budget == 0 || estimate.memory <= memory_budget)
+	&& (! best || estimate.work < best->work))
+      best = &estimate;
+
+  if (best)
+    plan.reason = (memory_budget == 0 ? "least estimated work" : "least estimated work within the memory budget");
+  else
+    {
+      for (const StrategyEstimate &estimate : plan.estimates)
+	if (! best || estimate.memory < best->memory)
+	  best = &estimate;
+      plan.reason = "nothing fits in the memory budget, so using the least memory";
+    }
+
+  plan.strategy = best->strategy;
+  return plan;
+}
+
+// Return a human-readable description of PLAN.
+//
+std::string
+explain_plan (const EditPlan &plan)
+{
+  std::string expl = "strategy: ";
+  expl += edit_strategy_names[plan.strategy];
+  expl += " (" + plan.reason + ")\n";
+
+  expl += "request: " + std::to_string (plan.from_length) + " x " + std::to_string (plan.to_length) + ", memory budget ";
+  expl += (plan.memory_budget == 0) ? std::string ("unlimited") : std::to_string (plan.memory_budget) + " bytes";
+  expl += ", cost bound ";
+  expl += (plan.max_cost == DISALLOWED) ? std::string ("none") : std::to_string (plan.max_cost);
+  if (plan.allow_disk)
+    expl += ", disk allowed";
+  if (plan.any_optimal)
+    expl += ", any optimal edits";
+  expl += '\n';
+
+  for (const StrategyEstimate &estimate : plan.estimates)
+    {
+      expl += "  ";
+      expl += edit_strategy_names[estimate.strategy];
+      expl += ": memory " + std::to_string (estimate.memory) + " bytes, work "
+	+ std::to_string (uint64_t (estimate.work)) + " entries";
+      if (plan.memory_budget != 0 && estimate.memory > plan.memory_budget)
+	expl += " (over budget)";
+      expl += '\n';
+    }
+
+  return expl;
+}
+
+// Compute optimal edits using the strategy chosen by PLAN.  Returns
+// true and sets EDITS if they cost at most the plan's MAX_COST, or
+// false if not.
+//
+bool
+compute_planned_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+		       const EditPlan &plan, std::list<Edit> &edits)
+{
+  switch (plan.strategy)
+    {
+    case BANDED:
+      return compute_banded_edits (from, to, costs, plan.max_cost, edits);
+    case WAVEFRONT:
+      return compute_wavefront_edits (from, to, costs, plan.max_cost, edits);
+    case FULL_MATRIX:
+      edits = compute_optimal_edits (from, to, costs);
+      break;
+    case CHECKPOINTED:
+      edits = compute_checkpointed_edits (from, to, costs, plan.memory_budget);
+      break;
+    case FOUR_RUSSIANS:
+      edits = compute_four_russians_edits (from, to, costs);
+      break;
+    case OUT_OF_CORE:
+      {
+	size_t tile_bytes = default_trace_tile_bytes;
+	if (plan.memory_budget != 0)
+	  tile_bytes = std::min (tile_bytes, plan.memory_budget / 2);
+	edits = compute_out_of_core_edits (from, to, costs, "", tile_bytes);
+      }
+      break;
+    }
+
+  if (plan.max_cost != DISALLOWED && edits_cost (edits, costs) > plan.max_cost)
+    {
+      edits.clear ();
+      return false;
+    }
+  return true;
+}
+
+// Plan and compute optimal edits in one go.  If PLAN is non-null, the
+// plan used is stored there.  ALLOW_DISK and ANY_OPTIMAL are as for
+// plan_edits.
+//
+bool
+compute_planned_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+		       size_t memory_budget, unsigned max_cost, std::list<Edit> &edits, EditPlan *plan = nullptr,
+		       bool allow_disk = false, bool any_optimal = false)
+{
+  EditPlan new_plan = plan_edits (from.length (), to.length (), costs, memory_budget, max_cost, allow_disk,
+				  any_optimal);
+  if (plan)
+    *plan = new_plan;
+  return compute_planned_edits (from, to, costs, new_plan, edits);
+}
+
+
+// Approximate search
+//
+// To find approximate occurrences of a short pattern in a long text,
+// we use a semi-global variant of the cost matrix, with the text as
+// the FROM string and the pattern as the TO string, in which deleting
+// text before or after the occurrence is free.  The matrix is
+// computed a column (text position) at a time, so the text can be
+// streamed through in a single pass, keeping only the last couple of
+// columns.  Any entry costing more than the limit can never lead to a
+// hit, since costs only grow along a path, so each column is only
+// computed down to just past its last entry within the limit.
+//
+
+struct SearchHit
+{
+  // The text position just after the occurrence, and its cost.
+  //
+  size_t end;
+  unsigned cost;
+
+  // If edits were requested, the position of the start of the
+  // occurrence, and the edits which turn TEXT[START, END) into the
+  // pattern.
+  //
+  size_t start;
+  std::list<Edit> edits;
+};
+
+// Compute the optimal edits to turn any suffix of TEXT into PATTERN,
+// setting START to where the suffix starts.
+//
+std::list<Edit>
+compute_suffix_edits (const std::string &text, const std::string &pattern, const EditCosts &costs, size_t &start)
+{
+  unsigned text_length = text.length ();
+  size_t row_length = text_length + 1;
+
+  // This is the usual computation with TEXT as FROM, except that the
+  // first row is all zeros, as leading deletions are free.
+  //
+  UniformCosts uniform_costs (costs, text);
+  std::vector<unsigned char> trace ((pattern.length () + 1) * row_length);
+  std::vector<unsigned> prev2_row (row_length), prev_row (row_length, 0), row (row_length);
+  fill_edit_rows (text, pattern, uniform_costs, 0, pattern.length (), prev2_row, prev_row, row,
+		  [&] (unsigned to_idx) { return &trace[(to_idx + 1) * row_length]; },
+		  [] (unsigned) { });
+
+  std::list<Edit> result;
+  unsigned from_idx = text_length, to_idx = pattern.length ();
+  while (to_idx > 0)
+    {
+      EditType type = EditType (trace[to_idx * row_length + from_idx]);
+      result.push_front (step_back (type, text, pattern, to_idx, from_idx));
+    }
+
+  start = from_idx;
+  return result;
+}
+
+class ApproximateSearch
+{
+public:
+
+  // Search for occurrences of PATTERN costing at most MAX_COST with
+  // COSTS.  If WANT_EDITS is true, the edits for each hit are
+  // computed too, which means remembering enough of the text to hold
+  // the longest possible occurrence.
+  //
+  ApproximateSearch (const std::string &pattern, const EditCosts &costs, unsigned max_cost, bool want_edits = false)
+    : _pattern (pattern), _costs (costs), _max_cost (max_cost),
+      _dead (max_cost == DISALLOWED ? DISALLOWED : max_cost + 1), _want_edits (want_edits),
+      _transpose (costs[TRANSPOSE] != DISALLOWED)
+  {
+    for (unsigned col = 0; col < 3; col++)
+      {
+	_columns[col].assign (pattern.length () + 1, _dead);
+	_column_ends[col] = pattern.length ();
+      }
+
+    // Before any text, the only option is inserting the pattern.
+    //
+    std::vector<unsigned> &column = _columns[0];
+    column[0] = 0;
+    unsigned row = 0;
+    while (row < pattern.length () && uint64_t (column[row]) + costs[INSERT] <= max_cost)
+      {
+	column[row + 1] = column[row] + costs[INSERT];
+	row++;
+      }
+    _column_ends[0] = row;
+
+    // An occurrence of length L needs at least L - PATTERN_LENGTH
+    // deletions.
+    //
+    _max_occurrence = max_history;
+    if (costs[DELETE] && pattern.length () + max_cost / costs[DELETE] < max_history)
+      _max_occurrence = pattern.length () + max_cost / costs[DELETE];
+  }
+
+  // Process the next LENGTH characters of the text at DATA, calling
+  // REPORT with a SearchHit for each occurrence ending within them.
+  //
+  template<class ReportFn>
+  void feed (const char *data, size_t length, ReportFn report)
+  {
+    for (size_t idx = 0; idx < length; idx++)
+      {
+	char text_ch = data[idx];
+	step (text_ch);
+	_position++;
+
+	if (_want_edits)
+	  {
+	    _history += text_ch;
+	    if (_history.length () > 2 * _max_occurrence)
+	      _history.erase (0, _history.length () - _max_occurrence);
+	  }
+
+	unsigned cost = _columns[_cur][_pattern.length ()];
+	if (cost <= _max_cost)
+	  {
+	    SearchHit hit;
+	    hit.end = _position;
+	    hit.cost = cost;
+	    hit.start = _position;
+	    if (_want_edits)
+	      {
+		size_t window = std::min (_history.length (), _max_occurrence);
+		size_t start;
+		hit.edits = compute_suffix_edits (_history.substr (_history.length () - window), _pattern, _costs, start);
+		hit.start = _position - window + start;
+	      }
+	    report (hit);
+	  }
+      }
+  }
+
+  // The number of text characters processed so far.
+  //
+  size_t position () const { return _position; }
+
+private:
+
+  // Compute the column for TEXT_CH from the previous ones.
+  //
+  void step (char text_ch)
+  {
+    unsigned prev2 = (_cur + 2) % 3, prev = _cur;
+    _cur = (_cur + 1) % 3;
+
+    const unsigned *prev2_col = _columns[prev2].data ();
+    const unsigned *prev_col = _columns[prev].data ();
+    unsigned *col = _columns[_cur].data ();
+    unsigned pattern_length = _pattern.length ();
+    unsigned limit = std::max (_column_ends[prev] + 1, _transpose ? _column_ends[prev2] + 2 : 0);
+
+    col[0] = 0;
+    unsigned row = 1;
+    for (; row <= pattern_length; row++)
+      {
+	if (row > limit && uint64_t (col[row - 1]) + _costs[INSERT] > _max_cost)
+	  break;
+
+	// The sums are done in 64 bits, as with no limit on the cost,
+	// dead entries are DISALLOWED, and adding to them would wrap.
+	//
+	char pattern_ch = _pattern[row - 1];
+	uint64_t cost = std::min ({ uint64_t (col[row - 1]) + _costs[INSERT],
+				    uint64_t (prev_col[row]) + _costs[DELETE],
+				    uint64_t (prev_col[row - 1]) + _costs[text_ch == pattern_ch ? SKIP : REPLACE] });
+	if (_transpose && row > 1 && _position > 0
+	    && _prev_text_ch == pattern_ch && text_ch == _pattern[row - 2] && text_ch != pattern_ch)
+	  cost = std::min (cost, uint64_t (prev2_col[row - 2]) + _costs[TRANSPOSE]);
+	col[row] = unsigned (std::min<uint64_t> (cost, _dead));
+      }
+
+    // Everything below what we computed must be dead, including any
+    // left over from the column that was last in this buffer.
+    //
+    unsigned end = row - 1;
+    for (unsigned stale = row; stale <= _column_ends[_cur]; stale++)
+      col[stale] = _dead;
+    while (end > 0 && col[end] == _dead)
+      end--;
+    _column_ends[_cur] = end;
+
+    _prev_text_ch = text_ch;
+  }
+
+  // The most text remembered for computing edits, if the costs don't
+  // bound the length of an occurrence more tightly.
+  //
+  static const size_t max_history = 1 << 20;
+
+  std::string _pattern;
+  EditCosts _costs;
+  unsigned _max_cost, _dead;
+  bool _want_edits, _transpose;
+
+  // The last three columns, used round-robin, with _CUR the latest,
+  // and the last row of each which might be within the limit;
+  // entries above the limit are clamped to _DEAD.
+  //
+  std::array<std::vector<unsigned>, 3> _columns;
+  std::array<unsigned, 3> _column_ends;
+  unsigned _cur = 0;
+
+  size_t _position = 0;
+  char _prev_text_ch = 0;
+
+  std::string _history;
+  size_t _max_occurrence = 0;
+};
+
+// Search the text read from IN with SEARCH, reading BUFFER_SIZE bytes
+// at a time, and calling REPORT for each hit.
+//
+template<class ReportFn>
+void
+search_stream (std::istream &in, ApproximateSearch &search, ReportFn report, size_t buffer_size = 1 << 16)
+{
+  std::vector<char> buffer (buffer_size);
+  while (in)
+    {
+      in.read (buffer.data (), buffer_size);
+      search.feed (buffer.data (), in.gcount (), report);
+    }
+}
+
+
+// Incremental sessions
+//
+// In interactive use the TO string often grows or shrinks at the end a
+// character at a time.  The cost matrix is filled in a row per TO
+// character, so appending to TO only adds rows to it, and truncating
+// TO only removes them.  An EditSession keeps what it needs to do that
+// without starting again: the last two rows, checkpoints of earlier
+// rows to restart from after truncating, and optionally the edit for
+// every entry, so the optimal edits can be replayed at any time.
+//
+// Appending a character then takes O(FROM_LENGTH) time, and
+// truncating O(FROM_LENGTH * INTERVAL) time at worst.
+//
+// Sessions are parameterized by the costs policy, like
+// compute_optimal_edits_with: EditSession uses EditCosts, and
+// TableEditSession a CostTable.
+//
+template<class Costs>
+class BasicEditSession
+{
+public:
+
+  // Start a session for edits from FROM to an empty TO string.  If
+  // KEEP_TRACE is false, the edits for each entry aren't kept, which
+  // saves a byte per matrix entry, but edits () has to recompute them.
+  // Rows are checkpointed every INTERVAL rows.
+  //
+  BasicEditSession (const std::string &from, const typename Costs::Source &costs, bool keep_trace = true,
+		    unsigned interval = default_interval);
+
+  // The policy refers to our own members, so sessions can't be copied.
+  //
+  BasicEditSession (const BasicEditSession &) = delete;
+  BasicEditSession &operator= (const BasicEditSession &) = delete;
+
+  // Add CHARS to the end of TO.
+  //
+  void append (const std::string &chars);
+  void append (char ch) { append (std::string (1, ch)); }
+
+  // Shorten TO to LENGTH characters, if it's longer.
+  //
+  void truncate (unsigned length);
+
+  // Change TO to NEW_TO, reusing the rows for the prefix they share.
+  //
+  void assign (const std::string &new_to);
+
+  const std::string &from () const { return _from; }
+  const std::string &to () const { return _to; }
+
+  // The cost of the optimal edits from FROM to TO.
+  //
+  unsigned cost () const { return _prev_row[_from.length ()]; }
+
+  // The optimal edits from FROM to TO, the same as
+  // compute_optimal_edits would return.
+  //
+  std::list<Edit> edits () const;
+
+  static const unsigned default_interval = 16;
+
+private:
+
+  // Fill in rows FIRST_TO_IDX + 1 to END_TO_IDX, recording their edits
+  // if RECORD_TRACE, and checkpointing them as we go.
+  //
+  void fill_rows (unsigned first_to_idx, unsigned end_to_idx, bool record_trace);
+
+  std::string _from, _to;
+  typename Costs::Source _source;
+  Costs _costs;
+  bool _keep_trace, _transpose;
+  unsigned _interval;
+
+  // The edit for every entry, in row-major order, if _KEEP_TRACE, or
+  // else a single row for the kernel to write to.
+  //
+  std::vector<unsigned char> _trace, _scratch_trace;
+
+  // Checkpoint SEG holds row SEG * _INTERVAL, and the one before it if
+  // transpositions are allowed.
+  //
+  std::vector<std::vector<unsigned> > _checkpoints, _prev_checkpoints;
+
+  std::vector<unsigned> _prev2_row, _prev_row, _row;
+};
+
+typedef BasicEditSession<UniformCosts> EditSession;
+typedef BasicEditSession<TableCosts> TableEditSession;
+
+template<class Costs>
+BasicEditSession<Costs>::BasicEditSession (const std::string &from, const typename Costs::Source &costs,
+					   bool keep_trace, unsigned interval)
+  : _from (from), _source (costs), _costs (_source, _from), _keep_trace (keep_trace),
+    _transpose (_costs.transpose_cost () != DISALLOWED), _interval (std::max (interval, 1u)),
+    _trace (from.length () + 1), _scratch_trace (from.length () + 1),
+    _prev2_row (from.length () + 1), _prev_row (from.length () + 1), _row (from.length () + 1)
+{
+  fill_first_edit_row (_from, _costs, _prev_row.data (), _trace.data ());
+  _checkpoints.push_back (_prev_row);
+  if (_transpose)
+    _prev_checkpoints.push_back (_prev2_row);
+}
+
+template<class Costs>
+void
+BasicEditSession<Costs>::fill_rows (unsigned first_to_idx, unsigned end_to_idx, bool record_trace)
+{
+  size_t row_length = _from.length () + 1;
+
+  fill_edit_rows (_from, _to, _costs, first_to_idx, end_to_idx, _prev2_row, _prev_row, _row,
+		  [&] (unsigned to_idx)
+		  {
+		    return record_trace ? &_trace[(to_idx + 1) * row_length] : _scratch_trace.data ();
+		  },
+		  [&] (unsigned to_idx)
+		  {
+		    if ((to_idx + 1) % _interval == 0)
+		      {
+			_checkpoints.push_back (_prev_row);
+			if (_transpose)
+			  _prev_checkpoints.push_back (_prev2_row);
+		      }
+		  });
+}
+
+template<class Costs>
+void
+BasicEditSession<Costs>::append (const std::string &chars)
+{
+  unsigned first_to_idx = _to.length ();
+  _to += chars;
+  if (_keep_trace)
+    _trace.resize ((_to.length () + 1) * (_from.length () + 1));
+  fill_rows (first_to_idx, _to.length (), _keep_trace);
+}
+
+template<class Costs>
+void
+BasicEditSession<Costs>::truncate (unsigned length)
+{
+  if (length >= _to.length ())
+    return;
+
+  // Go back to the last checkpoint at or before the new end, and
+  // recompute the rows from there.  Their edits are already in the
+  // trace, and haven't changed.
+  //
+  unsigned seg = length / _interval;
+  _checkpoints.resize (seg + 1);
+  _prev_row = _checkpoints[seg];
+  if (_transpose)
+    {
+      _prev_checkpoints.resize (seg + 1);
+      _prev2_row = _prev_checkpoints[seg];
+    }
+
+  _to.resize (length);
+  if (_keep_trace)
+    _trace.resize ((length + 1) * (_from.length () + 1));
+  fill_rows (seg * _interval, length, false);
+}
+
+template<class Costs>
+void
+BasicEditSession<Costs>::assign (const std::string &new_to)
+{
+  unsigned common = 0;
+  while (common < _to.length () && common < new_to.length () && _to[common] == new_to[common])
+    common++;
+
+  truncate (common);
+  append (new_to.substr (common));
+}
+
+template<class Costs>
+std::list<Edit>
+BasicEditSession<Costs>::edits () const
+{
+  if (!_keep_trace)
+    return compute_checkpointed_edits (_from, _to, _source);
+  return replay_edits (_from, _to, _trace);
+}
+
+
+// Incremental edits
+//
+// When FROM or TO is changed in the middle, the entries of the cost
+// matrix before the change are still right, but every entry after it
+// may have changed.  However the entries of the matrix for the
+// reversed strings are the costs of the optimal edits between the
+// suffixes of FROM and TO, and those after the change are still
+// right.  Every path through the matrix crosses each row (or jumps
+// over it with a transposition), so the optimal cost is the least
+// over a row of the sum of the costs of the best paths to and from
+// each entry, and similarly for a column.
+//
+// So we keep both matrices, and after a change to TO, only need to
+// recompute rows for the changed characters in one or the other and
+// join them along a row next to the change, or after a change to
+// FROM, columns, joining along a column.  That takes time
+// proportional to the size of the change times the length of the
+// other string.  Changes in several places cost more, as the
+// matrices must be brought up to date between them, and so does
+// switching between changing FROM and TO, though never much more
+// than computing the edits from scratch.
+//
+// The edits cost the same as those compute_optimal_edits returns,
+// but where there are several optimal paths, may follow a different
+// one.
+//
+
+// One of the matrices for IncrementalEdits.  The entries which are up
+// to date are kept track of by how many in each row are, which never
+// increases from one row to the next.
+//
+class PartialEditMatrix
+{
+public:
+
+  PartialEditMatrix (const CostTable &costs)
+    : _costs (costs), _transpose (costs.transpose_cost != DISALLOWED), _valid (1, 0)
+  { }
+
+  const std::string &from () const { return _from; }
+  const std::string &to () const { return _to; }
+
+  // Replace LENGTH characters of FROM (or TO) starting at POS with
+  // TEXT, and forget about the entries that depended on them.
+  //
+  void replace_from (unsigned pos, unsigned length, const std::string &text);
+  void replace_to (unsigned pos, unsigned length, const std::string &text);
+
+  // Forget about all the entries, so that the next update fills in
+  // whole rows.
+  //
+  void invalidate () { std::fill (_valid.begin (), _valid.end (), 0); }
+
+  // Return the number of entries which would need recomputing for
+  // every row up to and including ROW to be up to date, for each ROW;
+  // and similarly for every column up to and including COL.
+  //
+  std::vector<size_t> missing_by_row () const;
+  std::vector<size_t> missing_by_col () const;
+
+  // Bring the entries in rows before END_ROW and columns before
+  // END_COL up to date, returning how many needed recomputing.
+  //
+  size_t update (unsigned end_row, unsigned end_col);
+
+  unsigned cost (unsigned row, unsigned col) const { return _rows[row][col]; }
+  EditType type (unsigned row, unsigned col) const { return EditType (_trace[row][col]); }
+
+private:
+
+  // Compute the entry at ROW and COL from the ones before it, in the
+  // same way as fill_edit_row.
+  //
+  void compute_entry (unsigned row, unsigned col);
+
+  std::string _from, _to;
+  const CostTable &_costs;
+  bool _transpose;
+
+  // The policy for filling in whole rows with fill_edit_row, which is
+  // only made when needed, as it depends on FROM.
+  //
+  std::unique_ptr<TableCosts> _row_costs;
+
+  // The cost of each entry, the edit chosen for it, and how many
+  // entries are up to date, by row.
+  //
+  std::vector<std::vector<unsigned> > _rows;
+  std::vector<std::vector<unsigned char> > _trace;
+  std::vector<unsigned> _valid;
+};
+
+void
+PartialEditMatrix::replace_from (unsigned pos, unsigned length, const std::string &text)
+{
+  _from.replace (pos, length, text);
+  _row_costs.reset ();
+  for (unsigned &valid : _valid)
+    valid = std::min (valid, pos + 1);
+}
+
+void
+PartialEditMatrix::replace_to (unsigned pos, unsigned length, const std::string &text)
+{
+  _to.replace (pos, length, text);
+  _valid.resize (_to.length () + 1);
+  std::fill (_valid.begin () + pos + 1, _valid.end (), 0);
+}
+
+std::vector<size_t>
+PartialEditMatrix::missing_by_row () const
+{
+  std::vector<size_t> missing (_to.length () + 1);
+  size_t total = 0;
+  for (unsigned row = 0; row <= _to.length (); row++)
+    {
+      total += _from.length () + 1 - _valid[row];
+      missing[row] = total;
+    }
+  return missing;
+}
+
+std::vector<size_t>
+PartialEditMatrix::missing_by_col () const
+{
+  // As the counts never increase, the rows missing entries in a
+  // column are those from some row on, which only moves upwards as
+  // the column increases.
+  //
+  std::vector<size_t> missing (_from.length () + 1);
+  unsigned first_row = _to.length () + 1;
+  size_t valid_sum = 0;
+  for (unsigned col = 0; col <= _from.length (); col++)
+    {
+      while (first_row > 0 && _valid[first_row - 1] <= col)
+	valid_sum += _valid[--first_row];
+      missing[col] = size_t (_to.length () + 1 - first_row) * (col + 1) - valid_sum;
+    }
+  return missing;
+}
+
+void
+PartialEditMatrix::compute_entry (unsigned row, unsigned col)
+{
+  if (row == 0)
+    {
+      _rows[0][col] = col == 0 ? 0 : _rows[0][col - 1] + _costs.delete_costs[uchar (_from[col - 1])];
+      _trace[0][col] = col == 0 ? SKIP : DELETE;
+      return;
+    }
+
+  char to_ch = _to[row - 1];
+  if (col == 0)
+    {
+      _rows[row][0] = _rows[row - 1][0] + _costs.insert_costs[uchar (to_ch)];
+      _trace[row][0] = INSERT;
+      return;
+    }
+
+  char from_ch = _from[col - 1];
+  EditType rep_type = (from_ch == to_ch) ? SKIP : REPLACE;
+
+  unsigned ins_cost = _rows[row - 1][col] + _costs.insert_costs[uchar (to_ch)];
+  unsigned del_cost = _rows[row][col - 1] + _costs.delete_costs[uchar (from_ch)];
+  unsigned rep_cost = _rows[row - 1][col - 1] + _costs.subst (from_ch, to_ch);
+
+  unsigned cost;
+  EditType type;
+  if (ins_cost < del_cost && ins_cost < rep_cost)
+    {
+      cost = ins_cost;
+      type = INSERT;
+    }
+  else if (del_cost < rep_cost)
+    {
+      cost = del_cost;
+      type = DELETE;
+    }
+  else
+    {
+      cost = rep_cost;
+      type = rep_type;
+    }
+
+  if (_transpose && row > 1 && col > 1
+      && _from[col - 2] == to_ch && from_ch == _to[row - 2] && from_ch != to_ch)
+    {
+      unsigned trn_cost = _rows[row - 2][col - 2] + _costs.transpose_cost;
+      if (trn_cost < cost)
+	{
+	  cost = trn_cost;
+	  type = TRANSPOSE;
+	}
+    }
+
+  _rows[row][col] = cost;
+  _trace[row][col] = type;
+}
+
+size_t
+PartialEditMatrix::update (unsigned end_row, unsigned end_col)
+{
+  unsigned row_length = _from.length () + 1;
+  _rows.resize (_to.length () + 1);
+  _trace.resize (_to.length () + 1);
+
+  size_t recomputed = 0;
+  for (unsigned row = 0; row < end_row; row++)
+    {
+      unsigned first_col = _valid[row];
+      if (first_col >= end_col)
+	continue;
+
+      _rows[row].resize (row_length);
+      _trace[row].resize (row_length);
+      recomputed += end_col - first_col;
+
+      // Whole rows can use the usual kernel.
+      //
+      if (row > 0 && first_col == 0 && end_col == row_length)
+	{
+	  if (! _row_costs)
+	    _row_costs.reset (new TableCosts (_costs, _from));
+	  _row_costs->start_row (_to[row - 1]);
+	  const unsigned *prev2_row = row > 1 ? _rows[row - 2].data () : nullptr;
+	  if (_transpose)
+	    fill_edit_row<true> (_from, _to, row - 1, *_row_costs, prev2_row, _rows[row - 1].data (),
+				 _rows[row].data (), _trace[row].data ());
+	  else
+	    fill_edit_row<false> (_from, _to, row - 1, *_row_costs, prev2_row, _rows[row - 1].data (),
+				  _rows[row].data (), _trace[row].data ());
+	}
+      else
+	for (unsigned col = first_col; col < end_col; col++)
+	  compute_entry (row, col);
+
+      _valid[row] = end_col;
+    }
+
+  return recomputed;
+}
+
+// The optimal edits between FROM and TO, kept up to date as either is
+// changed.
+//
+class IncrementalEdits
+{
+public:
+
+  IncrementalEdits (const std::string &from, const std::string &to, const CostTable &costs);
+  IncrementalEdits (const std::string &from, const std::string &to, const EditCosts &costs)
+    : IncrementalEdits (from, to, CostTable (costs))
+  { }
+
+  // The matrices refer to our cost table, so this can't be copied.
+  //
+  IncrementalEdits (const IncrementalEdits &) = delete;
+  IncrementalEdits &operator= (const IncrementalEdits &) = delete;
+
+  // Replace LENGTH characters of FROM (or TO) starting at POS with
+  // TEXT.
+  //
+  void replace_from (unsigned pos, unsigned length, const std::string &text);
+  void replace_to (unsigned pos, unsigned length, const std::string &text);
+
+  const std::string &from () const { return _forward.from (); }
+  const std::string &to () const { return _forward.to (); }
+
+  // The cost of the optimal edits, and the edits themselves.  These
+  // do the recomputation needed after any changes.
+  //
+  unsigned cost () { update (); return _cost; }
+  const std::list<Edit> &edits () { update (); return _edits; }
+
+  // The number of matrix entries recomputed to bring the edits up to
+  // date after the last changes, including those of a matrix filled
+  // in from scratch when that's quicker.
+  //
+  size_t recomputed_entries () const { return _recomputed; }
+
+private:
+
+  void update ();
+
+  // Join the matrices along row INDEX, or column INDEX if BY_COL,
+  // setting _COST and _EDITS.
+  //
+  void join (bool by_col, unsigned index);
+
+  // Record a change to the rows (or columns, if BY_COL) from FIRST to
+  // END of the cost matrix.
+  //
+  void changed (bool by_col, unsigned first, unsigned end);
+
+  CostTable _costs;
+
+  // The matrices for FROM and TO, and for them reversed.
+  //
+  PartialEditMatrix _forward, _backward;
+
+  // Where the last change was, as more changes are likely to be near
+  // it.
+  //
+  bool _change_by_col = false;
+  unsigned _change_first = 0, _change_end = 0;
+
+  bool _up_to_date = false;
+  unsigned _cost = 0;
+  std::list<Edit> _edits;
+  size_t _recomputed = 0;
+};
+
+IncrementalEdits::IncrementalEdits (const std::string &from, const std::string &to, const CostTable &costs)
+  : _costs (costs), _forward (_costs), _backward (_costs)
+{
+  _forward.replace_from (0, 0, from);
+  _forward.replace_to (0, 0, to);
+  _backward.replace_from (0, 0, std::string (from.rbegin (), from.rend ()));
+  _backward.replace_to (0, 0, std::string (to.rbegin (), to.rend ()));
+
+  // Start with both matrices complete, so the first change in either
+  // string can be dealt with locally.
+  //
+  _recomputed = (_forward.update (to.length () + 1, from.length () + 1)
+		 + _backward.update (to.length () + 1, from.length () + 1));
+  join (false, to.length ());
+  _up_to_date = true;
+}
+
+void
+IncrementalEdits::replace_from (unsigned pos, unsigned length, const std::string &text)
+{
+  unsigned from_length = from ().length ();
+  pos = std::min (pos, from_length);
+  length = std::min (length, from_length - pos);
+
+  _forward.replace_from (pos, length, text);
+  _backward.replace_from (from_length - pos - length, length, std::string (text.rbegin (), text.rend ()));
+  changed (true, pos, pos + text.length () + 1);
+}
+
+void
+IncrementalEdits::replace_to (unsigned pos, unsigned length, const std::string &text)
+{
+  unsigned to_length = to ().length ();
+  pos = std::min (pos, to_length);
+  length = std::min (length, to_length - pos);
+
+  _forward.replace_to (pos, length, text);
+  _backward.replace_to (to_length - pos - length, length, std::string (text.rbegin (), text.rend ()));
+  changed (false, pos, pos + text.length () + 1);
+}
+
+void
+IncrementalEdits::changed (bool by_col, unsigned first, unsigned end)
+{
+  _change_by_col = by_col;
+  _change_first = first;
+  _change_end = end;
+  _up_to_date = false;
+}
+
+void
+IncrementalEdits::update ()
+{
+  if (_up_to_date)
+    return;
+
+  // Join along a row after changes to TO, and a column after changes
+  // to FROM, so that both matrices are up to date across the whole
+  // string either side of it, ready for more changes nearby.  Joining
+  // along a row needs the forward matrix up to it and the backward
+  // one from it, which is up to the corresponding row of the reversed
+  // strings.  We choose the one with the fewest entries to recompute,
+  // and among those, the nearest to the last change.
+  //
+  unsigned from_length = from ().length (), to_length = to ().length ();
+  bool by_col = _change_by_col;
+  std::vector<size_t> forward_missing = by_col ? _forward.missing_by_col () : _forward.missing_by_row ();
+  std::vector<size_t> backward_missing = by_col ? _backward.missing_by_col () : _backward.missing_by_row ();
+
+  unsigned length = by_col ? from_length : to_length;
+  unsigned index = 0, least_distance = 0;
+  size_t least = std::numeric_limits<size_t>::max ();
+  for (unsigned pos = 0; pos <= length; pos++)
+    {
+      size_t missing = forward_missing[pos] + backward_missing[length - pos];
+      unsigned distance = (pos < _change_first ? _change_first - pos
+			   : pos > _change_end ? pos - _change_end : 0);
+      if (missing < least || (missing == least && distance < least_distance))
+	{
+	  least = missing;
+	  least_distance = distance;
+	  index = pos;
+	}
+    }
+
+  // Entries recomputed one at a time with compute_entry take about
+  // half as long again as whole rows filled by fill_edit_row, so once
+  // changes to both strings have left most of a matrix's worth to fix
+  // up, it's quicker to fill in the forward matrix from scratch and
+  // join along its last row or column, which the backward matrix
+  // hardly needs anything for.
+  //
+  size_t entries = size_t (from_length + 1) * (to_length + 1);
+  if (least * 3 > entries * 2)
+    {
+      _forward.invalidate ();
+      index = length;
+    }
+
+  if (by_col)
+    _recomputed = (_forward.update (to_length + 1, index + 1)
+		   + _backward.update (to_length + 1, from_length - index + 1));
+  else
+    _recomputed = (_forward.update (index + 1, from_length + 1)
+		   + _backward.update (to_length - index + 1, from_length + 1));
+
+  join (by_col, index);
+  _up_to_date = true;
+}
+
+void
+IncrementalEdits::join (bool by_col, unsigned index)
+{
+  const std::string &from = _forward.from (), &to = _forward.to ();
+  unsigned from_length = from.length (), to_length = to.length ();
+  unsigned trn_cost = _costs.transpose_cost;
+
+  // Find the best entry on the row or column, or pair of entries
+  // either side of it joined by a transposition.
+  //
+  unsigned to_idx = 0, from_idx = 0;
+  bool transposed = false;
+  _cost = DISALLOWED;
+  unsigned length = by_col ? to_length : from_length;
+  for (unsigned pos = 0; pos <= length; pos++)
+    {
+      unsigned row = by_col ? pos : index, col = by_col ? index : pos;
+      unsigned cost = _forward.cost (row, col) + _backward.cost (to_length - row, from_length - col);
+      if (cost < _cost)
+	{
+	  _cost = cost;
+	  to_idx = row;
+	  from_idx = col;
+	  transposed = false;
+	}
+
+      // A transposition from ROW - 1, COL - 1 to ROW + 1, COL + 1
+      // jumps over ROW and COL.
+      //
+      if (trn_cost != DISALLOWED && row > 0 && col > 0 && row < to_length && col < from_length
+	  && from[col - 1] == to[row] && from[col] == to[row - 1] && from[col] != to[row])
+	{
+	  cost = (_forward.cost (row - 1, col - 1) + trn_cost
+		  + _backward.cost (to_length - row - 1, from_length - col - 1));
+	  if (cost < _cost)
+	    {
+	      _cost = cost;
+	      to_idx = row - 1;
+	      from_idx = col - 1;
+	      transposed = true;
+	    }
+	}
+    }
+
+  // Follow the forward matrix back to the start, and the backward one
+  // back to the end, which produces the edits after the join in
+  // order.  Transpositions in it are of the reversed pairs, so their
+  // characters are swapped.
+  //
+  _edits.clear ();
+  unsigned fwd_to_idx = to_idx, fwd_from_idx = from_idx;
+  while (fwd_to_idx > 0 || fwd_from_idx > 0)
+    {
+      EditType type = _forward.type (fwd_to_idx, fwd_from_idx);
+      _edits.push_front (step_back (type, from, to, fwd_to_idx, fwd_from_idx));
+    }
+
+  if (transposed)
+    {
+      _edits.push_back (Edit (TRANSPOSE, from[from_idx], to[to_idx]));
+      to_idx += 2;
+      from_idx += 2;
+    }
+
+  const std::string &rev_from = _backward.from (), &rev_to = _backward.to ();
+  unsigned bwd_to_idx = to_length - to_idx, bwd_from_idx = from_length - from_idx;
+  while (bwd_to_idx > 0 || bwd_from_idx > 0)
+    {
+      EditType type = _backward.type (bwd_to_idx, bwd_from_idx);
+      Edit edit = step_back (type, rev_from, rev_to, bwd_to_idx, bwd_from_idx);
+      if (type == TRANSPOSE)
+	std::swap (edit.from_ch, edit.to_ch);
+      _edits.push_back (edit);
+    }
+}
+
+
+// Dictionary lookups
+//
+// To find the words in a list within some cost of a query, the query
+// is the FROM string and each word a TO string.  Each row of the cost
+// matrix only depends on the TO string up to that row, so words with
+// a common prefix share the rows for it.  Putting the words in a trie
+// and walking it depth-first, keeping a row per level, computes the
+// rows for each prefix once however many words share it.
+//
+// A subtree can also be skipped altogether once no entry in the
+// current row is within the limit (nor in the previous row, if a
+// transposition could jump over the current one), as the costs along
+// a path never decrease.
+//
+
+struct DictionaryMatch
+{
+  // The index of the word in the list, and the cost of the optimal
+  // edits from the query to it.
+  //
+  unsigned word;
+  unsigned cost;
+};
+
+class EditDictionary
+{
+public:
+
+  EditDictionary (const std::vector<std::string> &words);
+
+  unsigned size () const { return _words.size (); }
+  const std::string &word (unsigned idx) const { return _words[idx]; }
+
+  // Return the words whose optimal edits from QUERY with COSTS cost at
+  // most MAX_COST, in the order of the list.
+  //
+  std::vector<DictionaryMatch> search (const std::string &query, const EditCosts &costs, unsigned max_cost) const
+  {
+    UniformCosts uniform_costs (costs, query);
+    return search_with (query, uniform_costs, max_cost);
+  }
+  std::vector<DictionaryMatch> search (const std::string &query, const CostTable &costs, unsigned max_cost) const
+  {
+    TableCosts table_costs (costs, query);
+    return search_with (query, table_costs, max_cost);
+  }
+
+private:
+
+  template<class Costs>
+  std::vector<DictionaryMatch> search_with (const std::string &query, Costs &costs, unsigned max_cost) const;
+
+  // The nodes of the trie are in depth-first order, so a node's
+  // subtree is the nodes from it up to SUBTREE_END.  The words ending
+  // at a node are in _ORDER from WORDS_BEGIN to WORDS_END.
+  //
+  struct Node
+  {
+    char ch;
+    unsigned depth;
+    unsigned subtree_end;
+    unsigned words_begin, words_end;
+  };
+
+  std::vector<std::string> _words;
+  std::vector<unsigned> _order;
+  std::vector<Node> _nodes;
+  unsigned _max_depth = 0;
+};
+
+EditDictionary::EditDictionary (const std::vector<std::string> &words)
+  : _words (words), _order (words.size ())
+{
+  // Adding the words in sorted order creates the nodes depth-first,
+  // with PATH holding the nodes for the prefix of the last one.
+  //
+  for (unsigned idx = 0; idx < words.size (); idx++)
+    _order[idx] = idx;
+  std::stable_sort (_order.begin (), _order.end (),
+		    [&] (unsigned a, unsigned b) { return _words[a] < _words[b]; });
+
+  std::vector<unsigned> path (1, 0);
+  _nodes.push_back (Node { 0, 0, 0, 0, 0 });
+  const std::string *prev_word = nullptr;
+  for (unsigned pos = 0; pos < _order.size (); pos++)
+    {
+      const std::string &word = _words[_order[pos]];
+      unsigned common = 0;
+      if (prev_word)
+	while (common < prev_word->length () && common < word.length () && (*prev_word)[common] == word[common])
+	  common++;
+
+      while (path.size () > common + 1)
+	{
+	  _nodes[path.back ()].subtree_end = _nodes.size ();
+	  path.pop_back ();
+	}
+      for (unsigned depth = common + 1; depth <= word.length (); depth++)
+	{
+	  path.push_back (_nodes.size ());
+	  _nodes.push_back (Node { word[depth - 1], depth, 0, pos, pos });
+	}
+
+      Node &node = _nodes[path.back ()];
+      if (node.words_begin == node.words_end)
+	node.words_begin = pos;
+      node.words_end = pos + 1;
+
+      _max_depth = std::max<unsigned> (_max_depth, word.length ());
+      prev_word = &word;
+    }
+
+  for (unsigned node_idx : path)
+    _nodes[node_idx].subtree_end = _nodes.size ();
+}
+
+template<class Costs>
+std::vector<DictionaryMatch>
+EditDictionary::search_with (const std::string &query, Costs &costs, unsigned max_cost) const
+{
+  size_t row_length = query.length () + 1;
+  bool transpose = (costs.transpose_cost () != DISALLOWED);
+
+  // ROWS[DEPTH] is the row for the prefix of the current node at
+  // DEPTH, which is held in PREFIX.
+  //
+  std::vector<std::vector<unsigned> > rows (_max_depth + 1, std::vector<unsigned> (row_length));
+  std::vector<unsigned> row_mins (_max_depth + 1);
+  std::vector<unsigned char> trace_row (row_length);
+  std::string prefix (_max_depth, 0);
+
+  std::vector<DictionaryMatch> matches;
+  auto report = [&] (const Node &node, const std::vector<unsigned> &row)
+    {
+      unsigned cost = row[query.length ()];
+      if (cost <= max_cost)
+	for (unsigned pos = node.words_begin; pos < node.words_end; pos++)
+	  matches.push_back (DictionaryMatch { _order[pos], cost });
+    };
+
+  fill_first_edit_row (query, costs, rows[0].data (), trace_row.data ());
+  row_mins[0] = *std::min_element (rows[0].begin (), rows[0].end ());
+  report (_nodes[0], rows[0]);
+
+  unsigned node_idx = 1;
+  while (node_idx < _nodes.size ())
+    {
+      const Node &node = _nodes[node_idx];
+      unsigned depth = node.depth;
+      prefix[depth - 1] = node.ch;
+
+      costs.start_row (node.ch);
+      std::vector<unsigned> &row = rows[depth];
+      if (transpose)
+	fill_edit_row<true> (query, prefix, depth - 1, costs, depth > 1 ? rows[depth - 2].data () : nullptr,
+			     rows[depth - 1].data (), row.data (), trace_row.data ());
+      else
+	fill_edit_row<false> (query, prefix, depth - 1, costs, nullptr,
+			      rows[depth - 1].data (), row.data (), trace_row.data ());
+      row_mins[depth] = *std::min_element (row.begin (), row.end ());
+
+      report (node, row);
+
+      // Every path to a later row goes through this one, or with a
+      // transposition, jumps from the previous one.
+      //
+      bool live = row_mins[depth] <= max_cost;
+      if (transpose && ! live && row_mins[depth - 1] <= max_cost)
+	live = row_mins[depth - 1] + costs.transpose_cost () <= max_cost;
+      node_idx = live ? node_idx + 1 : node.subtree_end;
+    }
+
+  std::sort (matches.begin (), matches.end (),
+	     [] (const DictionaryMatch &a, const DictionaryMatch &b) { return a.word < b.word; });
+  return matches;
+}
+
+
+// Prefilters
+//
+// When only edits costing at most some limit are of interest, pairs
+// of strings which are obviously far apart can be rejected without
+// filling in any of the cost matrix, using edit_cost_lower_bound.  It
+// only needs to know how many characters could possibly match, for
+// which the shorter length will do, or better, the size of the
+// intersection of the strings' character histograms.
+//
+
+struct PrefilterStats
+{
+  // The number of pairs seen, rejected by each filter in turn, and
+  // passed on to the full computation.
+  //
+  size_t pairs = 0, length_rejected = 0, histogram_rejected = 0, passed = 0;
+};
+
+// Return a lower bound on the cost of the optimal edits between
+// strings of lengths FROM_LENGTH and TO_LENGTH with COSTS.
+//
+unsigned
+length_lower_bound (unsigned from_length, unsigned to_length, const EditCosts &costs)
+{
+  return edit_cost_lower_bound (from_length, to_length, std::min (from_length, to_length), costs);
+}
+
+// Return a lower bound on the cost of the optimal edits from FROM to
+// TO with COSTS, which takes into account which characters they
+// contain.  The histograms have a fixed size, so the compiler can
+// vectorize the loop over them.
+//
+unsigned
+histogram_lower_bound (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  std::array<unsigned, 256> from_counts {}, to_counts {};
+  for (char ch : from)
+    from_counts[uchar (ch)]++;
+  for (char ch : to)
+    to_counts[uchar (ch)]++;
+
+  unsigned matchable = 0;
+  for (unsigned ch = 0; ch < 256; ch++)
+    matchable += std::min (from_counts[ch], to_counts[ch]);
+
+  return edit_cost_lower_bound (from.length (), to.length (), matchable, costs);
+}
+
+// Return false if the optimal edits from FROM to TO with COSTS
+// certainly cost more than MAX_COST, or true if they might not,
+// counting the outcome in STATS if it's non-null.
+//
+bool
+prefilter_edits (const std::string &from, const std::string &to, const EditCosts &costs, unsigned max_cost,
+		 PrefilterStats *stats = nullptr)
+{
+  PrefilterStats local_stats;
+  if (! stats)
+    stats = &local_stats;
+
+  stats->pairs++;
+  if (length_lower_bound (from.length (), to.length (), costs) > max_cost)
+    {
+      stats->length_rejected++;
+      return false;
+    }
+  if (histogram_lower_bound (from, to, costs) > max_cost)
+    {
+      stats->histogram_rejected++;
+      return false;
+    }
+  stats->passed++;
+  return true;
+}
+
+// Compute the same optimal edits as compute_optimal_edits, returning
+// true and setting EDITS to them if they cost at most MAX_COST, and
+// otherwise returning false, after only the prefilters if possible.
+//
+bool
+compute_filtered_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+			unsigned max_cost, std::list<Edit> &edits, PrefilterStats *stats = nullptr)
+{
+  if (! prefilter_edits (from, to, costs, max_cost, stats))
+    {
+      edits.clear ();
+      return false;
+    }
+  return compute_banded_edits (from, to, costs, max_cost, edits);
+}
+
+
+// Metric indexing
+//
+// A BK-tree indexes strings under a metric: each child of a node is
+// labelled with its distance from it, and by the triangle inequality,
+// a subtree with label L can only contain strings within R of a query
+// if L is within R of the query's distance to the node.
+//
+// The cost of optimal edits isn't a metric in general, as EditCosts
+// can be asymmetric, and transpositions break the triangle inequality.
+// Instead we index under a weighted Levenshtein distance which is a
+// lower bound on it, in the same way as for the wavefront engine:
+// every path consumes N + M characters, so with a base cost B charged
+// for each, twice the cost of a path is B * (N + M) plus a penalty for
+// each edit:
+//
+//   skip:      2 * (SKIP - B)
+//   replace:   2 * (REPLACE - B)
+//   insert:    2 * INSERT - B
+//   delete:    2 * DELETE - B
+//   transpose: 2 * TRANSPOSE - 4 * B
+//
+// B is chosen as large as possible with these all non-negative.  The
+// metric charges nothing for a match, the smaller of the insert and
+// delete penalties for either, and for a substitution, no more than
+// the replace penalty or half the transpose penalty, as a
+// transposition is two substitutions in the metric.
+//
+
+struct MetricCosts
+{
+  unsigned base, indel, subst;
+};
+
+MetricCosts
+metric_costs_for (const EditCosts &costs)
+{
+  int64_t base = std::min<int64_t> ({ costs[SKIP], costs[REPLACE], 2 * int64_t (costs[INSERT]),
+				      2 * int64_t (costs[DELETE]) });
+  if (costs[TRANSPOSE] != DISALLOWED)
+    base = std::min<int64_t> (base, costs[TRANSPOSE] / 2);
+
+  int64_t indel = std::min (2 * int64_t (costs[INSERT]), 2 * int64_t (costs[DELETE])) - base;
+  int64_t subst = std::min (2 * (int64_t (costs[REPLACE]) - base), 2 * indel);
+  if (costs[TRANSPOSE] != DISALLOWED)
+    subst = std::min (subst, (2 * int64_t (costs[TRANSPOSE]) - 4 * base) / 2);
+
+  return MetricCosts { unsigned (base), unsigned (indel), unsigned (subst) };
+}
+
+// Return the distance between A and B under METRIC.
+//
+unsigned
+metric_distance (const std::string &a, const std::string &b, const MetricCosts &metric)
+{
+  std::vector<unsigned> row (a.length () + 1);
+  for (unsigned a_idx = 0; a_idx <= a.length (); a_idx++)
+    row[a_idx] = a_idx * metric.indel;
+
+  for (unsigned b_idx = 0; b_idx < b.length (); b_idx++)
+    {
+      unsigned diag = row[0];
+      row[0] += metric.indel;
+      for (unsigned a_idx = 0; a_idx < a.length (); a_idx++)
+	{
+	  unsigned above = row[a_idx + 1];
+	  row[a_idx + 1] = std::min ({ above + metric.indel, row[a_idx] + metric.indel,
+				       diag + (a[a_idx] == b[b_idx] ? 0 : metric.subst) });
+	  diag = above;
+	}
+    }
+
+  return row[a.length ()];
+}
+
+class BKTree
+{
+public:
+
+  BKTree (const EditCosts &costs) : _costs (costs), _metric (metric_costs_for (costs)) { }
+
+  void add (const std::string &word);
+
+  unsigned size () const { return _nodes.size (); }
+  const std::string &word (unsigned idx) const { return _nodes[idx].word; }
+  const EditCosts &costs () const { return _costs; }
+
+  // Return the words whose optimal edits from QUERY cost at most
+  // MAX_COST, in the order they were added.  If VISITED is non-null,
+  // it's set to the number of words compared against the query.
+  //
+  std::vector<DictionaryMatch> search (const std::string &query, unsigned max_cost,
+				       size_t *visited = nullptr) const;
+
+  // Return the COUNT words whose optimal edits from QUERY cost least,
+  // cheapest first, with ties broken by the order they were added.
+  //
+  std::vector<DictionaryMatch> nearest (const std::string &query, unsigned count,
+					size_t *visited = nullptr) const;
+
+  // Save the index to PATH, or load one saved there.  Throws
+  // std::runtime_error if the file can't be written or read.
+  //
+  void save (const std::string &path) const;
+  static BKTree load (const std::string &path);
+
+private:
+
+  // Return the cost of the optimal edits from QUERY to WORD, or
+  // DISALLOWED if it's more than MAX_COST.
+  //
+  unsigned bounded_cost (const std::string &query, const std::string &word, unsigned max_cost) const;
+
+  struct Node
+  {
+    std::string word;
+
+    // The distance to each child, and its index.
+    //
+    std::vector<std::pair<unsigned, unsigned> > children;
+
+    // The node this is a child of, and its distance from it, for
+    // saving.
+    //
+    unsigned parent, distance;
+  };
+
+  EditCosts _costs;
+  MetricCosts _metric;
+  std::vector<Node> _nodes;
+};
+
+void
+BKTree::add (const std::string &word)
+{
+  unsigned idx = _nodes.size ();
+  _nodes.push_back (Node { word, { }, 0, 0 });
+  if (idx == 0)
+    return;
+
+  unsigned node_idx = 0;
+  for (;;)
+    {
+      Node &node = _nodes[node_idx];
+      unsigned distance = metric_distance (node.word, word, _metric);
+      auto child = std::find_if (node.children.begin (), node.children.end (),
+				 [&] (const std::pair<unsigned, unsigned> &c) { return c.first == distance; });
+      if (child == node.children.end ())
+	{
+	  node.children.push_back (std::make_pair (distance, idx));
+	  _nodes[idx].parent = node_idx;
+	  _nodes[idx].distance = distance;
+	  return;
+	}
+      node_idx = child->second;
+    }
+}
+
+unsigned
+BKTree::bounded_cost (const std::string &query, const std::string &word, unsigned max_cost) const
+{
+  std::list<Edit> edits;
+  if (! compute_filtered_edits (query, word, _costs, max_cost, edits))
+    return DISALLOWED;
+  return edits_cost (edits, _costs);
+}
+
+std::vector<DictionaryMatch>
+BKTree::search (const std::string &query, unsigned max_cost, size_t *visited) const
+{
+  std::vector<DictionaryMatch> matches;
+  if (visited)
+    *visited = 0;
+
+  // A word W can only match if its distance from the query is at most
+  // 2 * MAX_COST - BASE * (|QUERY| + |W|), and so at most RADIUS.
+  //
+  int64_t query_base = int64_t (_metric.base) * query.length ();
+  int64_t radius = 2 * int64_t (max_cost) - query_base;
+  if (_nodes.empty () || radius < 0)
+    return matches;
+
+  std::vector<unsigned> stack (1, 0);
+  while (! stack.empty ())
+    {
+      const Node &node = _nodes[stack.back ()];
+      unsigned node_idx = stack.back ();
+      stack.pop_back ();
+
+      int64_t distance = metric_distance (query, node.word, _metric);
+      if (visited)
+	++*visited;
+
+      if (distance <= radius - int64_t (_metric.base) * int64_t (node.word.length ()))
+	{
+	  unsigned cost = bounded_cost (query, node.word, max_cost);
+	  if (cost <= max_cost)
+	    matches.push_back (DictionaryMatch { node_idx, cost });
+	}
+
+      for (const std::pair<unsigned, unsigned> &child : node.children)
+	if (std::abs (distance - int64_t (child.first)) <= radius)
+	  stack.push_back (child.second);
+    }
+
+  std::sort (matches.begin (), matches.end (),
+	     [] (const DictionaryMatch &a, const DictionaryMatch &b) { return a.word < b.word; });
+  return matches;
+}
+
+std::vector<DictionaryMatch>
+BKTree::nearest (const std::string &query, unsigned count, size_t *visited) const
+{
+  if (visited)
+    *visited = 0;
+
+  // BEST holds the best matches so far, as a heap with the worst on
+  // top.  Nodes are visited in order of a lower bound on the cost of
+  // the words in their subtrees, until it's worse than all of them.
+  //
+  auto worse = [] (const DictionaryMatch &a, const DictionaryMatch &b)
+    {
+      return a.cost < b.cost || (a.cost == b.cost && a.word < b.word);
+    };
+  std::vector<DictionaryMatch> best;
+  auto limit = [&] () { return best.size () < count ? DISALLOWED : best.front ().cost; };
+
+  typedef std::pair<int64_t, unsigned> Pending;
+  std::vector<Pending> pending;
+  auto pending_order = [] (const Pending &a, const Pending &b) { return a > b; };
+  if (count > 0 && ! _nodes.empty ())
+    pending.push_back (Pending (0, 0));
+
+  int64_t query_base = int64_t (_metric.base) * query.length ();
+  while (! pending.empty () && pending.front ().first <= limit ())
+    {
+      std::pop_heap (pending.begin (), pending.end (), pending_order);
+      unsigned node_idx = pending.back ().second;
+      pending.pop_back ();
+      const Node &node = _nodes[node_idx];
+
+      int64_t distance = metric_distance (query, node.word, _metric);
+      if (visited)
+	++*visited;
+
+      // Costs are whole numbers, so the bounds can be rounded up.
+      //
+      int64_t bound = (distance + query_base + int64_t (_metric.base) * node.word.length () + 1) / 2;
+      if (bound <= limit ())
+	{
+	  unsigned cost = bounded_cost (query, node.word, limit ());
+	  DictionaryMatch match { node_idx, cost };
+	  if (cost != DISALLOWED && (best.size () < count || worse (match, best.front ())))
+	    {
+	      if (best.size () == count)
+		{
+		  std::pop_heap (best.begin (), best.end (), worse);
+		  best.pop_back ();
+		}
+	      best.push_back (match);
+	      std::push_heap (best.begin (), best.end (), worse);
+	    }
+	}
+
+      for (const std::pair<unsigned, unsigned> &child : node.children)
+	{
+	  int64_t child_bound = (std::abs (distance - int64_t (child.first)) + query_base + 1) / 2;
+	  if (child_bound <= limit ())
+	    {
+	      pending.push_back (Pending (child_bound, child.second));
+	      std::push_heap (pending.begin (), pending.end (), pending_order);
+	    }
+	}
+    }
+
+  std::sort_heap (best.begin (), best.end (), worse);
+  return best;
+}
+
+// The index file format is a header line, a line with the costs, and
+// then a line per word, with the index of its parent, its distance
+// from it, its length and then the word itself.
+//
+static const char bk_tree_header[] = "optedit-bktree 1";
+
+void
+BKTree::save (const std::string &path) const
+{
+  std::ofstream out (path, std::ios::binary);
+  if (! out)
+    throw std::runtime_error (path + ": can't create index file");
+
+  out << bk_tree_header << '\n';
+  for (EditType type : { SKIP, INSERT, DELETE, REPLACE, TRANSPOSE })
+    out << _costs[type] << (type == TRANSPOSE ? '\n' : ' ');
+  for (const Node &node : _nodes)
+    out << node.parent << ' ' << node.distance << ' ' << node.word.length () << ' ' << node.word << '\n';
+
+  out.close ();
+  if (! out)
+    throw std::runtime_error (path + ": error writing index file");
+}
+
+BKTree
+BKTree::load (const std::string &path)
+{
+  std::ifstream in (path, std::ios::binary);
+  if (! in)
+    throw std::runtime_error (path + ": can't open index file");
+
+  auto bad_file = [&] () { return std::runtime_error (path + ": not a valid index file"); };
+
+  std::string header;
+  EditCosts costs;
+  if (! std::getline (in, header) || header != bk_tree_header)
+    throw bad_file ();
+  for (EditType type : { SKIP, INSERT, DELETE, REPLACE, TRANSPOSE })
+    in >> costs[type];
+  if (! in)
+    throw bad_file ();
+
+  // A word can't be longer than what's left of the file, so check
+  // that before allocating room for it.
+  //
+  std::streampos words_start = in.tellg ();
+  in.seekg (0, std::ios::end);
+  uint64_t file_length = in.tellg ();
+  in.seekg (words_start);
+
+  BKTree tree (costs);
+  unsigned parent, distance;
+  size_t length;
+  while (in >> parent >> distance >> length)
+    {
+      unsigned idx = tree._nodes.size ();
+      if (length > file_length - uint64_t (in.tellg ()))
+	throw bad_file ();
+      std::string word (length, 0);
+      if (in.get () != ' ' || ! in.read (&word[0], length) || in.get () != '\n'
+	  || (idx > 0 && parent >= idx))
+	throw bad_file ();
+
+      tree._nodes.push_back (Node { word, { }, parent, distance });
+      if (idx > 0)
+	tree._nodes[parent].children.push_back (std::make_pair (distance, idx));
+    }
+  if (! in.eof ())
+    throw bad_file ();
+
+  return tree;
+}
+
+
+// Q-gram filtering
+//
+// If the optimal edits from X to Y use at most E edits other than
+// skips, then as each edit can only affect the Q-grams (substrings of
+// length Q) overlapping it, which is at most Q of them (Q + 1 for a
+// transposition), at least |X| - Q + 1 - Q * E of X's Q-grams also
+// occur in Y.  They also occur at about the same position, as each
+// insertion or deletion only shifts the rest of the string along by
+// one.  The number of edits is bounded by the cost limit divided by
+// the cheapest edit, so an inverted index from Q-grams to where they
+// occur in a corpus quickly finds the few strings worth computing
+// the edits for.
+//
+
+// Append VALUE to OUT as a variable-length integer, seven bits per
+// byte, least significant first, with the top bit set on all but the
+// last.
+//
+void
+put_varint (std::string &out, uint64_t value)
+{
+  while (value >= 0x80)
+    {
+      out += char (value | 0x80);
+      value >>= 7;
+    }
+  out += char (value);
+}
+
+// Read a variable-length integer from POS, which mustn't reach END,
+// into VALUE, returning false if it's truncated.
+//
+bool
+get_varint (const unsigned char *&pos, const unsigned char *end, uint64_t &value)
+{
+  value = 0;
+  for (unsigned shift = 0; pos < end && shift < 64; shift += 7)
+    {
+      unsigned char byte = *pos++;
+      value |= uint64_t (byte & 0x7f) << shift;
+      if (! (byte & 0x80))
+	return true;
+    }
+  return false;
+}
+
+struct QGramSearchStats
+{
+  // The number of postings read, strings which passed the filters,
+  // and of those, the ones which matched.
+  //
+  size_t postings = 0, candidates = 0, matches = 0;
+};
+
+class QGramIndex
+{
+public:
+
+  // Index WORDS by their Q-grams, where Q is at most 8.
+  //
+  QGramIndex (const std::vector<std::string> &words, unsigned q = 3);
+
+  unsigned size () const { return _words.size (); }
+  unsigned q () const { return _q; }
+  const std::string &word (unsigned idx) const { return _words[idx]; }
+
+  // Return the words whose optimal edits from QUERY with COSTS cost at
+  // most MAX_COST, in the order of the list.  If STATS is non-null,
+  // it's set to how well the filters did.
+  //
+  std::vector<DictionaryMatch> search (const std::string &query, const EditCosts &costs, unsigned max_cost,
+				       QGramSearchStats *stats = nullptr) const;
+
+  // Return the words which pass the filters for the same search, which
+  // include all those that match, in the order of the list.
+  //
+  std::vector<unsigned> candidates (const std::string &query, const EditCosts &costs, unsigned max_cost,
+				    QGramSearchStats *stats = nullptr) const;
+
+  // Save the index to PATH, or load one saved there.  Throws
+  // std::runtime_error if the file can't be written or read.
+  //
+  void save (const std::string &path) const;
+  static QGramIndex load (const std::string &path);
+
+private:
+
+  QGramIndex (unsigned q) : _q (q) { }
+
+  // Return the Q-gram at the start of CHARS as an integer.
+  //
+  uint64_t qgram_key (const char *chars) const
+  {
+    uint64_t key = 0;
+    for (unsigned idx = 0; idx < _q; idx++)
+      key = (key << 8) | uchar (chars[idx]);
+    return key;
+  }
+
+  unsigned _q;
+  std::vector<std::string> _words;
+
+  // The Q-grams which occur, in order, and for each, the postings for
+  // where they occur, from _OFFSETS[I] to _OFFSETS[I + 1] in
+  // _POSTINGS.  Each posting is the difference from the previous
+  // word index, and the position in the word, or the difference from
+  // the previous position in the same word, as varints.
+  //
+  std::vector<uint64_t> _keys;
+  std::vector<size_t> _offsets;
+  std::string _postings;
+};
+
+QGramIndex::QGramIndex (const std::vector<std::string> &words, unsigned q)
+  : _q (std::max (1u, std::min (q, 8u))), _words (words)
+{
+  struct Occurrence
+  {
+    uint64_t key;
+    unsigned word, pos;
+    bool operator< (const Occurrence &other) const
+    {
+      return (key != other.key ? key < other.key : word != other.word ? word < other.word : pos < other.pos);
+    }
+  };
+
+  std::vector<Occurrence> occurrences;
+  for (unsigned word = 0; word < _words.size (); word++)
+    for (unsigned pos = 0; pos + _q <= _words[word].length (); pos++)
+      occurrences.push_back (Occurrence { qgram_key (&_words[word][pos]), word, pos });
+  std::sort (occurrences.begin (), occurrences.end ());
+
+  for (size_t idx = 0; idx < occurrences.size (); idx++)
+    {
+      const Occurrence &occ = occurrences[idx];
+      bool new_key = (idx == 0 || occ.key != occurrences[idx - 1].key);
+      if (new_key)
+	{
+	  _keys.push_back (occ.key);
+	  _offsets.push_back (_postings.length ());
+	}
+
+      unsigned prev_word = new_key ? 0 : occurrences[idx - 1].word;
+      bool same_word = ! new_key && occ.word == prev_word;
+      put_varint (_postings, occ.word - prev_word);
+      put_varint (_postings, same_word ? occ.pos - occurrences[idx - 1].pos : occ.pos);
+    }
+  _offsets.push_back (_postings.length ());
+}
+
+std::vector<unsigned>
+QGramIndex::candidates (const std::string &query, const EditCosts &costs, unsigned max_cost,
+			QGramSearchStats *stats) const
+{
+  QGramSearchStats local_stats;
+  if (! stats)
+    stats = &local_stats;
+  *stats = QGramSearchStats ();
+
+  // The most edits there can be, and the most insertions or deletions,
+  // and so how far apart matching Q-grams can be.
+  //
+  unsigned min_edit = std::min ({ costs[INSERT], costs[DELETE], costs[REPLACE], costs[TRANSPOSE] });
+  unsigned min_indel = std::min (costs[INSERT], costs[DELETE]);
+  uint64_t max_edits = min_edit ? max_cost / min_edit : DISALLOWED;
+
+  // Each query character is either skipped or consumed by an edit, so
+  // the cost is also |QUERY| * SKIP plus, for each edit, how much more
+  // it costs than skipping the query characters it consumes, which
+  // can give a tighter bound.
+  //
+  int64_t excess = std::min<int64_t> ({ int64_t (costs[REPLACE]) - costs[SKIP], int64_t (costs[DELETE]) - costs[SKIP],
+					costs[INSERT] });
+  if (costs[TRANSPOSE] != DISALLOWED)
+    excess = std::min (excess, int64_t (costs[TRANSPOSE]) - 2 * int64_t (costs[SKIP]));
+  if (excess > 0)
+    {
+      int64_t spare = std::max<int64_t> (0, max_cost - int64_t (query.length ()) * costs[SKIP]);
+      max_edits = std::min<uint64_t> (max_edits, spare / excess);
+    }
+
+  uint64_t max_shift = min_indel ? max_cost / min_indel : DISALLOWED;
+  uint64_t spoiled = (costs[TRANSPOSE] != DISALLOWED) ? _q + 1 : _q;
+
+  auto length_ok = [&] (unsigned word)
+    {
+      size_t length = _words[word].length ();
+      return (length > query.length () ? length - query.length () : query.length () - length) <= max_shift;
+    };
+
+  std::vector<unsigned> result;
+  int64_t num_qgrams = query.length () >= _q ? query.length () - _q + 1 : 0;
+  int64_t threshold = num_qgrams - int64_t (std::min<uint64_t> (max_edits * spoiled, num_qgrams));
+  if (threshold <= 0)
+    {
+      // Every word could match, except for its length.
+      //
+      for (unsigned word = 0; word < _words.size (); word++)
+	if (length_ok (word))
+	  result.push_back (word);
+      stats->candidates = result.size ();
+      return result;
+    }
+
+  // Count the query's Q-grams in each word near enough to where they
+  // are in the query, each at most once.
+  //
+  std::vector<unsigned> counts (_words.size ()), last_counted (_words.size ());
+  for (unsigned query_pos = 0; query_pos < num_qgrams; query_pos++)
+    {
+      uint64_t key = qgram_key (&query[query_pos]);
+      auto found = std::lower_bound (_keys.begin (), _keys.end (), key);
+      if (found == _keys.end () || *found != key)
+	continue;
+
+      size_t key_idx = found - _keys.begin ();
+      const unsigned char *pos = reinterpret_cast<const unsigned char *> (_postings.data ()) + _offsets[key_idx];
+      const unsigned char *end = reinterpret_cast<const unsigned char *> (_postings.data ()) + _offsets[key_idx + 1];
+      uint64_t word = 0, word_pos = 0, word_delta, pos_value;
+      bool first = true;
+      while (pos < end && get_varint (pos, end, word_delta) && get_varint (pos, end, pos_value))
+	{
+	  word += word_delta;
+	  word_pos = (word_delta == 0 && ! first) ? word_pos + pos_value : pos_value;
+	  first = false;
+	  stats->postings++;
+
+	  uint64_t shift = word_pos > query_pos ? word_pos - query_pos : query_pos - word_pos;
+	  if (shift <= max_shift && last_counted[word] != query_pos + 1)
+	    {
+	      last_counted[word] = query_pos + 1;
+	      counts[word]++;
+	    }
+	}
+    }
+
+  for (unsigned word = 0; word < _words.size (); word++)
+    if (counts[word] >= threshold && length_ok (word))
+      result.push_back (word);
+  stats->candidates = result.size ();
+  return result;
+}
+
+std::vector<DictionaryMatch>
+QGramIndex::search (const std::string &query, const EditCosts &costs, unsigned max_cost,
+		    QGramSearchStats *stats) const
+{
+  QGramSearchStats local_stats;
+  if (! stats)
+    stats = &local_stats;
+
+  std::vector<DictionaryMatch> matches;
+  std::list<Edit> edits;
+  for (unsigned word : candidates (query, costs, max_cost, stats))
+    if (compute_filtered_edits (query, _words[word], costs, max_cost, edits))
+      matches.push_back (DictionaryMatch { word, edits_cost (edits, costs) });
+
+  stats->matches = matches.size ();
+  return matches;
+}
+
+// The index file format is a header line, then the Q, the words and
+// the posting lists, all as varints or strings preceded by their
+// lengths.
+//
+static const char qgram_index_header[] = "optedit-qgram 1";
+
+void
+QGramIndex::save (const std::string &path) const
+{
+  std::ofstream out (path, std::ios::binary);
+  if (! out)
+    throw std::runtime_error (path + ": can't create index file");
+
+  std::string data;
+  put_varint (data, _q);
+  put_varint (data, _words.size ());
+  for (const std::string &word : _words)
+    {
+      put_varint (data, word.length ());
+      data += word;
+    }
+  put_varint (data, _keys.size ());
+  for (size_t key_idx = 0; key_idx < _keys.size (); key_idx++)
+    {
+      put_varint (data, _keys[key_idx] - (key_idx > 0 ? _keys[key_idx - 1] : 0));
+      put_varint (data, _offsets[key_idx + 1] - _offsets[key_idx]);
+    }
+  data += _postings;
+
+  out << qgram_index_header << '\n' << data;
+  out.close ();
+  if (! out)
+    throw std::runtime_error (path + ": error writing index file");
+}
+
+QGramIndex
+QGramIndex::load (const std::string &path)
+{
+  std::ifstream in (path, std::ios::binary);
+  if (! in)
+    throw std::runtime_error (path + ": can't open index file");
+
+  auto bad_file = [&] () { return std::runtime_error (path + ": not a valid index file"); };
+
+  std::string header;
+  if (! std::getline (in, header) || header != qgram_index_header)
+    throw bad_file ();
+  std::string data ((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char> ());
+
+  const unsigned char *pos = reinterpret_cast<const unsigned char *> (data.data ());
+  const unsigned char *end = pos + data.length ();
+  auto get = [&] (uint64_t limit)
+    {
+      uint64_t value;
+      if (! get_varint (pos, end, value) || value > limit)
+	throw bad_file ();
+      return value;
+    };
+  auto get_bytes = [&] (size_t length)
+    {
+      if (size_t (end - pos) < length)
+	throw bad_file ();
+      std::string bytes (reinterpret_cast<const char *> (pos), length);
+      pos += length;
+      return bytes;
+    };
+
+  uint64_t q = get (8);
+  if (q == 0)
+    throw bad_file ();
+  QGramIndex index (q);
+
+  index._words.resize (get (data.length ()));
+  for (std::string &word : index._words)
+    word = get_bytes (get (data.length ()));
+
+  uint64_t num_keys = get (data.length ());
+  uint64_t key = 0;
+  size_t postings_length = 0;
+  for (uint64_t key_idx = 0; key_idx < num_keys; key_idx++)
+    {
+      key += get (std::numeric_limits<uint64_t>::max ());
+      index._keys.push_back (key);
+      index._offsets.push_back (postings_length);
+      postings_length += get (data.length ());
+    }
+  index._offsets.push_back (postings_length);
+  index._postings = get_bytes (postings_length);
+  if (pos != end)
+    throw bad_file ();
+
+  // Searching trusts the postings, so make sure each one is for a
+  // word in the index, at a position a Q-gram fits in it.
+  //
+  for (uint64_t key_idx = 0; key_idx < num_keys; key_idx++)
+    {
+      pos = reinterpret_cast<const unsigned char *> (index._postings.data ()) + index._offsets[key_idx];
+      end = reinterpret_cast<const unsigned char *> (index._postings.data ()) + index._offsets[key_idx + 1];
+      uint64_t word = 0, word_pos = 0;
+      bool first = true;
+      while (pos < end)
+	{
+	  uint64_t word_delta = get (index._words.size ());
+	  uint64_t pos_value = get (data.length ());
+	  word += word_delta;
+	  word_pos = (word_delta == 0 && ! first) ? word_pos + pos_value : pos_value;
+	  first = false;
+	  if (word >= index._words.size () || word_pos + q > index._words[word].length ())
+	    throw bad_file ();
+	}
+    }
+
+  return index;
+}
+
+
+// Result cache
+//
+// Services often see the same requests over and over, so EditCache
+// keeps the results of recent computations, up to a memory limit,
+// throwing away the least recently used first.  It's split into
+// shards, each with its own lock, so concurrent lookups rarely wait
+// for each other.
+//
+// Entries are keyed by a 128-bit hash of the strings and costs rather
+// than the strings themselves, to keep them small.  The chance of two
+// different requests colliding by accident is negligible, but
+// MurmurHash3 collisions can be constructed on purpose, so an entry
+// also records the lengths of the strings, and is only used if they
+// match and its edits fit the strings.  A crafted collision can still
+// get the wrong result back, so don't share a cache between clients
+// that don't trust each other.  The edits are stored as runs of edit
+// types, as the characters can be recovered from the strings, which
+// only takes a byte or two per run.
+//
+
+struct Hash128
+{
+  uint64_t low, high;
+
+  bool operator== (const Hash128 &other) const { return low == other.low && high == other.high; }
+};
+
+// Return a 128-bit hash of the LENGTH bytes at DATA, starting from
+// SEED.  This is MurmurHash3's x64 128-bit variant.
+//
+Hash128
+hash128 (const void *data, size_t length, Hash128 seed = Hash128 { 0, 0 })
+{
+  const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  auto rotl = [] (uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto fmix = [] (uint64_t k)
+    {
+      k ^= k >> 33;
+      k *= 0xff51afd7ed558ccdULL;
+      k ^= k >> 33;
+      k *= 0xc4ceb9fe1a85ec53ULL;
+      k ^= k >> 33;
+      return k;
+    };
+
+  const unsigned char *bytes = static_cast<const unsigned char *> (data);
+  uint64_t h1 = seed.low, h2 = seed.high;
+
+  size_t num_blocks = length / 16;
+  for (size_t block = 0; block < num_blocks; block++)
+    {
+      uint64_t k1, k2;
+      std::memcpy (&k1, bytes + block * 16, 8);
+      std::memcpy (&k2, bytes + block * 16 + 8, 8);
+
+      k1 *= c1; k1 = rotl (k1, 31); k1 *= c2; h1 ^= k1;
+      h1 = rotl (h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+      k2 *= c2; k2 = rotl (k2, 33); k2 *= c1; h2 ^= k2;
+      h2 = rotl (h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+  const unsigned char *tail = bytes + num_blocks * 16;
+  uint64_t k1 = 0, k2 = 0;
+  for (size_t idx = length & 15; idx > 8; idx--)
+    k2 |= uint64_t (tail[idx - 1]) << ((idx - 9) * 8);
+  for (size_t idx = std::min<size_t> (length & 15, 8); idx > 0; idx--)
+    k1 |= uint64_t (tail[idx - 1]) << ((idx - 1) * 8);
+  if (length & 15)
+    {
+      k2 *= c2; k2 = rotl (k2, 33); k2 *= c1; h2 ^= k2;
+      k1 *= c1; k1 = rotl (k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix (h1);
+  h2 = fmix (h2);
+  h1 += h2;
+  h2 += h1;
+  return Hash128 { h1, h2 };
+}
+
+// Encode EDITS as runs of edit types: a byte with the type in the low
+// three bits and the run length less one in the next four, with the
+// top bit set if the rest of the run length follows as a varint.
+//
+std::string
+encode_edit_script (const std::list<Edit> &edits)
+{
+  std::string script;
+  auto edit = edits.begin ();
+  while (edit != edits.end ())
+    {
+      EditType type = edit->type;
+      uint64_t run = 0;
+      while (edit != edits.end () && edit->type == type)
+	{
+	  ++edit;
+	  run++;
+	}
+
+      uint64_t extra = (run - 1) >> 4;
+      script += char (type | ((run - 1) & 15) << 3 | (extra ? 0x80 : 0));
+      if (extra)
+	put_varint (script, extra);
+    }
+  return script;
+}
+
+// Set EDITS to the edits encoded in SCRIPT, which turn FROM into TO,
+// and return true, or return false if SCRIPT is malformed or doesn't
+// exactly cover FROM and TO.
+//
+bool
+decode_edit_script (const std::string &script, const std::string &from, const std::string &to,
+		    std::list<Edit> &edits)
+{
+  edits.clear ();
+  const unsigned char *pos = reinterpret_cast<const unsigned char *> (script.data ());
+  const unsigned char *end = pos + script.length ();
+  size_t from_idx = 0, to_idx = 0;
+  while (pos < end)
+    {
+      unsigned char byte = *pos++;
+      EditType type = EditType (byte & 7);
+      uint64_t run = ((byte >> 3) & 15) + 1, extra = 0;
+      if (type > TRANSPOSE || ((byte & 0x80) && ! get_varint (pos, end, extra)))
+	return false;
+      run += extra << 4;
+
+      size_t from_step = (type == INSERT ? 0 : type == TRANSPOSE ? 2 : 1);
+      size_t to_step = (type == DELETE ? 0 : type == TRANSPOSE ? 2 : 1);
+      if ((from_step && run > (from.length () - from_idx) / from_step)
+	  || (to_step && run > (to.length () - to_idx) / to_step))
+	return false;
+
+      for (; run > 0; run--)
+	{
+	  edits.push_back (Edit (type, from_step ? from[from_idx] : 0, to_step ? to[to_idx] : 0));
+	  from_idx += from_step;
+	  to_idx += to_step;
+	}
+    }
+  return from_idx == from.length () && to_idx == to.length ();
+}
+
+class EditCache
+{
+public:
+
+  // Make a cache using at most about MEMORY_LIMIT bytes, split into
+  // NUM_SHARDS shards.
+  //
+  EditCache (size_t memory_limit, unsigned num_shards = 16)
+    : _shards (std::max (num_shards, 1u)), _shard_limit (memory_limit / std::max (num_shards, 1u))
+  { }
+
+  // Return the optimal edits from FROM to TO with COSTS, or their
+  // cost, from the cache if possible, or else computing them with
+  // compute_optimal_edits, or just the cost with compute_edit_cost,
+  // and remembering the result.
+  //
+  std::list<Edit> edits (const std::string &from, const std::string &to, const EditCosts &costs);
+  unsigned cost (const std::string &from, const std::string &to, const EditCosts &costs);
+
+  struct Counters
+  {
+    size_t hits = 0, misses = 0, evictions = 0, entries = 0, memory = 0;
+  };
+
+  // Return the counters summed over all the shards.
+  //
+  Counters counters () const;
+
+  // Drop all the entries, and reset the counters.
+  //
+  void clear ();
+
+private:
+
+  struct Entry
+  {
+    Hash128 key;
+    size_t from_length, to_length;
+    unsigned cost;
+
+    // The edits, if they were asked for rather than just the cost.
+    //
+    bool has_script;
+    std::string script;
+  };
+
+  struct KeyHash
+  {
+    size_t operator() (const Hash128 &key) const { return key.low; }
+  };
+
+  // Each shard keeps its entries in order of use, most recent first,
+  // and a map to find them.
+  //
+  struct Shard
+  {
+    mutable std::mutex mutex;
+    std::list<Entry> entries;
+    std::unordered_map<Hash128, std::list<Entry>::iterator, KeyHash> map;
+    Counters counters;
+  };
+
+  // A rough count of the bytes used by ENTRY, including the overhead
+  // of the list and map nodes.
+  //
+  static size_t entry_memory (const Entry &entry) { return sizeof (Entry) + 64 + entry.script.capacity (); }
+
+  static Hash128 request_key (const std::string &from, const std::string &to, const EditCosts &costs)
+  {
+    Hash128 key = hash128 (from.data (), from.length ());
+    key = hash128 (to.data (), to.length (), key);
+    return hash128 (costs.data (), sizeof (costs), key);
+  }
+
+  Shard &shard_for (const Hash128 &key) { return _shards[key.high % _shards.size ()]; }
+
+  // Look up KEY, returning true and setting ENTRY to a copy if there's
+  // an entry for strings of FROM_LENGTH and TO_LENGTH with a script, or
+  // just a cost if NEED_SCRIPT is false.
+  //
+  bool lookup (const Hash128 &key, size_t from_length, size_t to_length, bool need_script, Entry &entry);
+
+  void insert (Entry &&entry);
+
+  std::vector<Shard> _shards;
+  size_t _shard_limit;
+};
+
+bool
+EditCache::lookup (const Hash128 &key, size_t from_length, size_t to_length, bool need_script, Entry &entry)
+{
+  Shard &shard = shard_for (key);
+  std::lock_guard<std::mutex> lock (shard.mutex);
+
+  auto found = shard.map.find (key);
+  if (found == shard.map.end ()
+      || found->second->from_length != from_length || found->second->to_length != to_length
+      || (need_script && ! found->second->has_script))
+    {
+      shard.counters.misses++;
+      return false;
+    }
+
+  shard.entries.splice (shard.entries.begin (), shard.entries, found->second);
+  shard.counters.hits++;
+  entry = *found->second;
+  return true;
+}
+
+void
+EditCache::insert (Entry &&entry)
+{
+  Shard &shard = shard_for (entry.key);
+  std::lock_guard<std::mutex> lock (shard.mutex);
+
+  // Another thread may have got there first, or there may be an entry
+  // with just the cost, or for a colliding request, to replace.
+  //
+  auto found = shard.map.find (entry.key);
+  if (found != shard.map.end ())
+    {
+      const Entry &old = *found->second;
+      if (old.from_length == entry.from_length && old.to_length == entry.to_length
+	  && (old.has_script || ! entry.has_script))
+	return;
+      shard.counters.memory -= entry_memory (*found->second);
+      shard.counters.entries--;
+      shard.entries.erase (found->second);
+      shard.map.erase (found);
+    }
+
+  size_t memory = entry_memory (entry);
+  if (memory > _shard_limit)
+    return;
+
+  while (shard.counters.memory + memory > _shard_limit)
+    {
+      const Entry &victim = shard.entries.back ();
+      shard.counters.memory -= entry_memory (victim);
+      shard.counters.entries--;
+      shard.counters.evictions++;
+      shard.map.erase (victim.key);
+      shard.entries.pop_back ();
+    }
+
+  shard.entries.push_front (std::move (entry));
+  shard.map[shard.entries.front ().key] = shard.entries.begin ();
+  shard.counters.memory += memory;
+  shard.counters.entries++;
+}
+
+std::list<Edit>
+EditCache::edits (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  Hash128 key = request_key (from, to, costs);
+  Entry entry;
+  std::list<Edit> result;
+  if (lookup (key, from.length (), to.length (), true, entry)
+      && decode_edit_script (entry.script, from, to, result))
+    return result;
+
+  result = compute_optimal_edits (from, to, costs);
+  insert (Entry { key, from.length (), to.length (), edits_cost (result, costs), true, encode_edit_script (result) });
+  return result;
+}
+
+unsigned
+EditCache::cost (const std::string &from, const std::string &to, const EditCosts &costs)
+{
+  Hash128 key = request_key (from, to, costs);
+  Entry entry;
+  if (lookup (key, from.length (), to.length (), false, entry))
+    return entry.cost;
+
+  static thread_local EditCostWorkspace workspace;
+  unsigned result = compute_edit_cost (from, to, costs, workspace);
+  insert (Entry { key, from.length (), to.length (), result, false, std::string () });
+  return result;
+}
+
+EditCache::Counters
+EditCache::counters () const
+{
+  Counters total;
+  for (const Shard &shard : _shards)
+    {
+      std::lock_guard<std::mutex> lock (shard.mutex);
+      total.hits += shard.counters.hits;
+      total.misses += shard.counters.misses;
+      total.evictions += shard.counters.evictions;
+      total.entries += shard.counters.entries;
+      total.memory += shard.counters.memory;
+    }
+  return total;
+}
+
+void
+EditCache::clear ()
+{
+  for (Shard &shard : _shards)
+    {
+      std::lock_guard<std::mutex> lock (shard.mutex);
+      shard.entries.clear ();
+      shard.map.clear ();
+      shard.counters = Counters ();
+    }
+}
+
+
+// Batches
+//
+// Batches of pairs often repeat the same pair, so compute_batch_edits
+// computes each distinct pair only once.  With symmetric costs, the
+// edits from TO to FROM are just those from FROM to TO with the roles
+// of the strings exchanged, so a pair which is another one swapped
+// around is also only computed once.
+//
+
+typedef std::pair<std::string, std::string> StringPair;
+
+struct BatchStats
+{
+  // The number of pairs, those computed, and those which were
+  // repeats, or mirror images, of ones computed.
+  //
+  size_t pairs = 0, computed = 0, repeated = 0, mirrored = 0;
+};
+
+// Return EDITS, which turn FROM into TO, changed to turn TO into FROM.
+//
+std::list<Edit>
+mirror_edits (const std::list<Edit> &edits)
+{
+  std::list<Edit> result;
+  for (const Edit &edit : edits)
+    {
+      EditType type = edit.type == INSERT ? DELETE : edit.type == DELETE ? INSERT : edit.type;
+      result.push_back (Edit (type, edit.to_ch, edit.from_ch));
+    }
+  return result;
+}
+
+// Return the optimal edits for each of PAIRS with COSTS.  The result
+// for a mirrored pair is optimal, but where there's a tie, may not be
+// the same as compute_optimal_edits would return; if MIRROR is false,
+// pairs are never mirrored.
+//
+std::vector<std::list<Edit> >
+compute_batch_edits (const std::vector<StringPair> &pairs, const EditCosts &costs, bool mirror = true,
+		     BatchStats *stats = nullptr)
+{
+  BatchStats local_stats;
+  if (! stats)
+    stats = &local_stats;
+  *stats = BatchStats ();
+  stats->pairs = pairs.size ();
+
+  mirror = mirror && costs[INSERT] == costs[DELETE];
+
+  auto pair_key = [] (const std::string &from, const std::string &to)
+    {
+      return hash128 (to.data (), to.length (), hash128 (from.data (), from.length ()));
+    };
+  struct KeyHash
+  {
+    size_t operator() (const Hash128 &key) const { return key.low; }
+  };
+
+  // The index of the first pair with each key.  Keys are only hashes,
+  // so the strings are compared too, and anything that collides is
+  // just computed.
+  //
+  std::unordered_map<Hash128, size_t, KeyHash> first_with_key;
+  std::vector<std::list<Edit> > results (pairs.size ());
+  for (size_t idx = 0; idx < pairs.size (); idx++)
+    {
+      const StringPair &pair = pairs[idx];
+      auto found = first_with_key.find (pair_key (pair.first, pair.second));
+      if (found != first_with_key.end () && pairs[found->second] == pair)
+	{
+	  results[idx] = results[found->second];
+	  stats->repeated++;
+	  continue;
+	}
+
+      if (mirror)
+	{
+	  found = first_with_key.find (pair_key (pair.second, pair.first));
+	  if (found != first_with_key.end ()
+	      && pairs[found->second].first == pair.second && pairs[found->second].second == pair.first)
+	    {
+	      results[idx] = mirror_edits (results[found->second]);
+	      stats->mirrored++;
+	      continue;
+	    }
+	}
+
+      results[idx] = compute_optimal_edits (pair.first, pair.second, costs);
+      first_with_key.emplace (pair_key (pair.first, pair.second), idx);
+      stats->computed++;
+    }
+
+  return results;
+}
+
+
+// All-pairs matrices
+//
+// For clustering, the costs between every pair of a set of strings
+// are needed, but not the edits.  Without a traceback, the cost only
+// needs the last couple of rows of the matrix, which each thread can
+// reuse from one pair to the next.  The pairs are split into square
+// tiles, so each thread works on a few strings at a time, and the
+// threads take tiles in turn.  With symmetric costs, only the pairs
+// with the first string before the second are computed.
+//
+// The costs are written to a file, mapped into memory so that the
+// threads can write straight into it, starting with a 16-byte header:
+// "OPTEDMAT", then the number of strings and a flags word with bit 0
+// set if only the upper triangle is stored, both 32-bit.  The costs
+// follow, also 32-bit, in row-major order, either for every pair or
+// for those above the diagonal.  Everything is in the host's byte
+// order.
+//
+
+const size_t all_pairs_header_size = 16;
+
+// Return the index among the costs in an all-pairs file for COUNT
+// strings of the cost from string FROM_IDX to TO_IDX; if TRIANGULAR,
+// FROM_IDX must be less than TO_IDX.
+//
+size_t
+all_pairs_index (unsigned count, bool triangular, unsigned from_idx, unsigned to_idx)
+{
+  if (! triangular)
+    return size_t (from_idx) * count + to_idx;
+  return size_t (from_idx) * (2 * size_t (count) - from_idx - 1) / 2 + (to_idx - from_idx - 1);
+}
+
+// Write the costs between each pair of STRINGS with COSTS to a new
+// file at PATH, using NUM_THREADS threads (or one per CPU if zero),
+// and tiles of TILE_SIZE by TILE_SIZE pairs.
+//
+void
+compute_all_pairs (const std::vector<std::string> &strings, const EditCosts &costs, const std::string &path,
+		   unsigned num_threads = 0, unsigned tile_size = 64)
+{
+  unsigned count = strings.size ();
+  bool triangular = (costs[INSERT] == costs[DELETE]);
+  size_t num_costs = triangular ? size_t (count) * (count - (count > 0)) / 2 : size_t (count) * count;
+  size_t file_size = all_pairs_header_size + num_costs * sizeof (uint32_t);
+
+  int fd = open (path.c_str (), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    throw std::system_error (errno, std::generic_category (), "creating " + path);
+
+  // Allocate the space up front, so running out of it is an error
+  // here rather than a signal later.
+  //
+  int err = posix_fallocate (fd, 0, off_t (file_size));
+  void *map = err ? MAP_FAILED : mmap (nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      err = err ? err : errno;
+      close (fd);
+      throw std::system_error (err, std::generic_category (), "allocating " + path);
+    }
+
+  unsigned char *data = static_cast<unsigned char *> (map);
+  uint32_t header_words[2] = { count, triangular ? 1u : 0u };
+  std::memcpy (data, "OPTEDMAT", 8);
+  std::memcpy (data + 8, header_words, sizeof (header_words));
+  uint32_t *matrix = reinterpret_cast<uint32_t *> (data + all_pairs_header_size);
+
+  // Tile (ROW_TILE, COL_TILE) covers the pairs from the strings in
+  // ROW_TILE to those in COL_TILE.  In the triangular case, only the
+  // tiles on or above the diagonal have pairs to compute.
+  //
+  tile_size = std::max (tile_size, 1u);
+  unsigned num_tiles = (count + tile_size - 1) / tile_size;
+  std::vector<std::pair<unsigned, unsigned> > tiles;
+  for (unsigned row_tile = 0; row_tile < num_tiles; row_tile++)
+    for (unsigned col_tile = triangular ? row_tile : 0; col_tile < num_tiles; col_tile++)
+      tiles.push_back (std::make_pair (row_tile, col_tile));
+
+  // If a thread fails, the first error is kept to rethrow once all
+  // the threads have finished, and the rest stop taking tiles.
+  //
+  std::atomic<size_t> next_tile (0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto work = [&] ()
+    {
+      try
+	{
+	  EditCostWorkspace workspace;
+	  for (size_t tile = next_tile++; tile < tiles.size (); tile = next_tile++)
+	    {
+	      unsigned first_row = tiles[tile].first * tile_size, first_col = tiles[tile].second * tile_size;
+	      unsigned end_row = std::min (first_row + tile_size, count);
+	      unsigned end_col = std::min (first_col + tile_size, count);
+	      for (unsigned from_idx = first_row; from_idx < end_row; from_idx++)
+		for (unsigned to_idx = triangular ? std::max (first_col, from_idx + 1) : first_col;
+		     to_idx < end_col; to_idx++)
+		  matrix[all_pairs_index (count, triangular, from_idx, to_idx)]
+		    = compute_edit_cost (strings[from_idx], strings[to_idx], costs, workspace);
+	    }
+	}
+      catch (...)
+	{
+	  std::lock_guard<std::mutex> lock (error_mutex);
+	  if (! error)
+	    error = std::current_exception ();
+	  next_tile = tiles.size ();
+	}
+    };
+
+  // If a thread can't be started, we make do with those that were.
+  //
+  if (num_threads == 0)
+    num_threads = std::max (1u, std::thread::hardware_concurrency ());
+  std::vector<std::thread> threads;
+  try
+    {
+      for (unsigned thread = 1; thread < num_threads; thread++)
+	threads.emplace_back (work);
+    }
+  catch (const std::system_error &)
+    { }
+  work ();
+  for (std::thread &thread : threads)
+    thread.join ();
+
+  munmap (map, file_size);
+  close (fd);
+  if (error)
+    std::rethrow_exception (error);
+}
+
+
+// Worker pools
+//
+// A fixed set of threads running tasks in the order they're queued.
+// Anything using the pool has to wait for its own tasks to finish;
+// when the pool is destroyed, the tasks already queued are run first.
+//
+
+class WorkerPool
+{
+public:
+
+  // Start NUM_THREADS threads, or one per CPU if zero.
+  //
+  explicit WorkerPool (unsigned num_threads = 0)
+  {
+    if (num_threads == 0)
+      num_threads = std::max (1u, std::thread::hardware_concurrency ());
+    for (unsigned thread = 0; thread < num_threads; thread++)
+      _threads.emplace_back ([this] () { work (); });
+  }
+
+  ~WorkerPool ()
+  {
+    {
+      std::lock_guard<std::mutex> lock (_mutex);
+      _stopping = true;
+    }
+    _wakeup.notify_all ();
+    for (std::thread &thread : _threads)
+      thread.join ();
+  }
+
+  WorkerPool (const WorkerPool &) = delete;
+  WorkerPool &operator= (const WorkerPool &) = delete;
+
+  unsigned size () const { return _threads.size (); }
+
+  void submit (std::function<void ()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock (_mutex);
+      _tasks.push_back (std::move (task));
+    }
+    _wakeup.notify_one ();
+  }
+
+private:
+
+  void work ()
+  {
+    for (;;)
+      {
+	std::function<void ()> task;
+	{
+	  std::unique_lock<std::mutex> lock (_mutex);
+	  _wakeup.wait (lock, [this] () { return _stopping || ! _tasks.empty (); });
+	  if (_tasks.empty ())
+	    return;
+	  task = std::move (_tasks.front ());
+	  _tasks.pop_front ();
+	}
+	task ();
+      }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  std::deque<std::function<void ()> > _tasks;
+  bool _stopping = false;
+  std::vector<std::thread> _threads;
+};
+
+
+// Edit requests
+//
+// The binary format used by the server and the pipeline mode, made of
+// 32-bit words in the host's byte order.  A request is a word with
+// the length of the rest of it, a flags word, the five EditCosts, the
+// lengths of FROM and TO, and then the bytes of FROM and TO.  Bit 0 of
+// the flags asks for the edits as well as the cost.
+//
+// A response is a word with the length of the rest of it, the cost,
+// and if asked for, the edits in the form encode_edit_script gives.
+// The cost is DISALLOWED if the request's costs aren't acceptable, or
+// the computation failed, for instance for lack of memory.
+//
+
+const uint32_t edit_request_want_edits = 1;
+
+// The largest request accepted, not counting its length word.
+//
+const uint32_t max_edit_request_length = 1 << 28;
+
+struct EditRequest
+{
+  std::string from, to;
+  EditCosts costs;
+  bool want_edits;
+};
+
+// Append REQUEST to OUT in the binary format.
+//
+void
+append_edit_request (std::string &out, const EditRequest &request)
+{
+  uint32_t words[9] = { 0, request.want_edits ? edit_request_want_edits : 0,
+			request.costs[0], request.costs[1], request.costs[2], request.costs[3], request.costs[4],
+			uint32_t (request.from.length ()), uint32_t (request.to.length ()) };
+  words[0] = sizeof (words) - sizeof (uint32_t) + request.from.length () + request.to.length ();
+  out.append (reinterpret_cast<const char *> (words), sizeof (words));
+  out += request.from;
+  out += request.to;
+}
+
+// If the LENGTH bytes at DATA start with a complete request, store it
+// in REQUEST and return its size, including the length word, or else
+// return zero.  Throws std::runtime_error if it's malformed.
+//
+size_t
+parse_edit_request (const char *data, size_t length, EditRequest &request)
+{
+  uint32_t words[9];
+  if (length < sizeof (uint32_t))
+    return 0;
+  std::memcpy (words, data, sizeof (uint32_t));
+  if (words[0] > max_edit_request_length || words[0] < sizeof (words) - sizeof (uint32_t))
+    throw std::runtime_error ("bad edit request length");
+  if (length < sizeof (uint32_t) + words[0])
+    return 0;
+
+  std::memcpy (words, data, sizeof (words));
+  if (uint64_t (words[7]) + words[8] != words[0] - (sizeof (words) - sizeof (uint32_t)))
+    throw std::runtime_error ("bad edit request string lengths");
+  request.want_edits = (words[1] & edit_request_want_edits) != 0;
+  std::copy (words + 2, words + 7, request.costs.begin ());
+  request.from.assign (data + sizeof (words), words[7]);
+  request.to.assign (data + sizeof (words) + words[7], words[8]);
+  return sizeof (uint32_t) + words[0];
+}
+
+// Compute the response to REQUEST, using WORKSPACE if only the cost
+// is wanted, and append it to OUT.  A request which can't be computed
+// gets a DISALLOWED cost rather than an exception, so one bad request
+// can't take down everything else going on.
+//
+void
+append_edit_response (std::string &out, const EditRequest &request, EditCostWorkspace &workspace)
+{
+  uint32_t words[2] = { sizeof (uint32_t), DISALLOWED };
+  std::string script;
+  if (std::find (request.costs.begin (), request.costs.begin () + TRANSPOSE, DISALLOWED)
+      == request.costs.begin () + TRANSPOSE)
+    try
+      {
+	if (request.want_edits)
+	  {
+	    std::list<Edit> edits = compute_optimal_edits (request.from, request.to, request.costs);
+	    script = encode_edit_script (edits);
+	    words[1] = edits_cost (edits, request.costs);
+	  }
+	else
+	  words[1] = compute_edit_cost (request.from, request.to, request.costs, workspace);
+      }
+    catch (const std::exception &)
+      {
+	script.clear ();
+	words[1] = DISALLOWED;
+      }
+  words[0] += script.length ();
+  out.append (reinterpret_cast<const char *> (words), sizeof (words));
+  out += script;
+}
+
+
+// Edit server
+//
+// Starting a process per comparison costs far more than comparing
+// short strings, so EditServer answers requests in the binary format
+// over a Unix domain socket.  Clients may send any number of requests
+// without waiting, and get the responses back in the same order.
+//
+// A single thread does all the I/O with epoll.  Requests from all the
+// connections are gathered into a batch, which is handed to a worker
+// pool once it's BATCH_WINDOW microseconds old or has MAX_BATCH
+// requests, whichever comes first, so a lone request is delayed by at
+// most the window, and under load the workers get big batches.  Only
+// one batch is worked on at a time, so responses are always sent in
+// order; the next one is gathered in the meantime.  So that no client
+// can hold up the others for long, a request whose matrix would have
+// more than MAX_CELLS entries is treated as malformed, and the client
+// is cut off.
+//
+// The server stops reading from a client which has a batch's worth of
+// requests outstanding, or a lot of input or responses buffered, and
+// from all of them while the next batch is full, until things drain,
+// so a client that pipelines without reading its responses can't make
+// it buffer without limit.
+//
+
+class EditServer
+{
+public:
+
+  // Listen on a socket at PATH.  If there's already a socket there
+  // which nothing is listening on, it's replaced, but anything else
+  // there is an error.
+  //
+  EditServer (const std::string &path, unsigned batch_window = 200, size_t max_batch = 4096,
+	      unsigned num_threads = 0, uint64_t max_cells = uint64_t (1) << 26);
+  ~EditServer ();
+
+  EditServer (const EditServer &) = delete;
+  EditServer &operator= (const EditServer &) = delete;
+
+  // Serve requests until an error other than from a single client.
+  //
+  void run ();
+
+private:
+
+  // The ids of the listening socket, the eventfd the workers use to
+  // say they've finished a batch, the batch window timer, and the
+  // timer for retrying accepting connections, in the epoll events;
+  // connections have ids from first_connection_id.
+  //
+  enum { listen_id, batch_done_id, timer_id, accept_timer_id, first_connection_id };
+
+  struct Connection
+  {
+    int fd;
+    std::string in, out;
+
+    // The number of requests in batches, and whether the client has
+    // finished sending them, so the connection can be closed once
+    // their responses are sent.
+    //
+    size_t outstanding = 0;
+    bool eof = false;
+
+    // Whether the client has gone away, so responses are dropped, and
+    // the epoll events the connection is registered for, if any.
+    //
+    bool gone = false;
+    uint32_t events = EPOLLIN;
+  };
+
+  struct Pending
+  {
+    uint64_t connection;
+    EditRequest request;
+    std::string response;
+  };
+
+  void accept_connections ();
+  void read_requests (uint64_t id);
+  void take_requests (uint64_t id, Connection &connection);
+  bool throttled (const Connection &connection) const;
+  void resume_connections ();
+  void write_responses (uint64_t id);
+  void update_events (uint64_t id, Connection &connection);
+  void close_if_done (uint64_t id);
+  void close_all ();
+  void start_batch ();
+  void finish_batch ();
+  void wait_for_batch ();
+
+  std::string _path;
+  int _listen_fd = -1, _epoll_fd = -1, _batch_done_fd = -1, _timer_fd = -1, _accept_timer_fd = -1;
+
+  // Whether the socket at PATH is ours, to remove at the end.
+  //
+  bool _bound = false;
+  unsigned _batch_window;
+  size_t _max_batch;
+  uint64_t _max_cells;
+
+  // How much input or output a connection may have buffered before
+  // the server stops reading from it.
+  //
+  static const size_t max_buffered = size_t (1) << 20;
+
+  std::map<uint64_t, Connection> _connections;
+  uint64_t _next_connection_id = first_connection_id;
+
+  // The batch being gathered, whether it's due to be started, and the
+  // one the workers are on, if BUSY.
+  //
+  std::vector<Pending> _batch, _running;
+  bool _batch_due = false, _busy = false;
+
+  // The workers use _running, so the pool must go first.
+  //
+  WorkerPool _pool;
+};
+
+EditServer::EditServer (const std::string &path, unsigned batch_window, size_t max_batch, unsigned num_threads,
+			uint64_t max_cells)
+  : _path (path), _batch_window (batch_window), _max_batch (std::max<size_t> (max_batch, 1)), _max_cells (max_cells),
+    _pool (num_threads)
+{
+  sockaddr_un addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (path.length () >= sizeof (addr.sun_path))
+    throw std::runtime_error (path + ": socket path too long");
+  std::strcpy (addr.sun_path, path.c_str ());
+
+  auto fail = [this] (const std::string &what)
+    {
+      int err = errno;
+      close_all ();
+      throw std::system_error (err, std::generic_category (), what);
+    };
+
+  _listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_listen_fd < 0)
+    fail ("creating socket");
+
+  struct stat existing;
+  if (lstat (path.c_str (), &existing) == 0)
+    {
+      if (! S_ISSOCK (existing.st_mode))
+	{
+	  errno = EEXIST;
+	  fail ("listening on " + path);
+	}
+
+      // A socket left behind by a server that's gone refuses
+      // connections.
+      //
+      int probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      bool stale = (probe >= 0 && connect (probe, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) != 0
+		    && errno == ECONNREFUSED);
+      if (probe >= 0)
+	close (probe);
+      if (! stale)
+	{
+	  errno = EADDRINUSE;
+	  fail ("listening on " + path);
+	}
+      unlink (path.c_str ());
+    }
+
+  if (bind (_listen_fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) != 0)
+    fail ("listening on " + path);
+  _bound = true;
+  if (listen (_listen_fd, SOMAXCONN) != 0)
+    fail ("listening on " + path);
+
+  _epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  _batch_done_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  _timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  _accept_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (_epoll_fd < 0 || _batch_done_fd < 0 || _timer_fd < 0 || _accept_timer_fd < 0)
+    fail ("setting up event handling");
+
+  std::pair<int, uint64_t> sources[4] = { { _listen_fd, listen_id }, { _batch_done_fd, batch_done_id },
+					  { _timer_fd, timer_id }, { _accept_timer_fd, accept_timer_id } };
+  for (auto &source : sources)
+    {
+      epoll_event event;
+      event.events = EPOLLIN;
+      event.data.u64 = source.second;
+      if (epoll_ctl (_epoll_fd, EPOLL_CTL_ADD, source.first, &event) != 0)
+	fail ("setting up event handling");
+    }
+}
+
+EditServer::~EditServer ()
+{
+  wait_for_batch ();
+  close_all ();
+}
+
+void
+EditServer::close_all ()
+{
+  for (auto &connection : _connections)
+    close (connection.second.fd);
+  _connections.clear ();
+  for (int fd : { _listen_fd, _epoll_fd, _batch_done_fd, _timer_fd, _accept_timer_fd })
+    if (fd >= 0)
+      close (fd);
+  if (_bound)
+    unlink (_path.c_str ());
+  _bound = false;
+  _listen_fd = _epoll_fd = _batch_done_fd = _timer_fd = _accept_timer_fd = -1;
+}
+
+void
+EditServer::run ()
+{
+  std::vector<epoll_event> events (64);
+  for (;;)
+    {
+      int num_events = epoll_wait (_epoll_fd, events.data (), events.size (), -1);
+      if (num_events < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  throw std::system_error (errno, std::generic_category (), "waiting for events");
+	}
+
+      for (int idx = 0; idx < num_events; idx++)
+	{
+	  uint64_t id = events[idx].data.u64;
+	  uint64_t count;
+	  switch (id)
+	    {
+	    case listen_id:
+	      accept_connections ();
+	      break;
+	    case batch_done_id:
+	      if (read (_batch_done_fd, &count, sizeof (count)) == sizeof (count))
+		finish_batch ();
+	      break;
+	    case timer_id:
+	      if (read (_timer_fd, &count, sizeof (count)) == sizeof (count))
+		_batch_due = true;
+	      break;
+	    case accept_timer_id:
+	      if (read (_accept_timer_fd, &count, sizeof (count)) == sizeof (count))
+		{
+		  epoll_event event;
+		  event.events = EPOLLIN;
+		  event.data.u64 = listen_id;
+		  epoll_ctl (_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &event);
+		  accept_connections ();
+		}
+	      break;
+	    default:
+	      if (events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		read_requests (id);
+	      if (events[idx].events & (EPOLLHUP | EPOLLERR))
+		{
+		  // Neither way works any more, so there's no one to
+		  // answer.
+		  //
+		  auto found = _connections.find (id);
+		  if (found != _connections.end ())
+		    {
+		      found->second.gone = found->second.eof = true;
+		      found->second.out.clear ();
+		      found->second.in.clear ();
+		      update_events (id, found->second);
+		      close_if_done (id);
+		    }
+		}
+	      else if (events[idx].events & EPOLLOUT)
+		write_responses (id);
+	      break;
+	    }
+	}
+
+      if (! _busy && _batch_due)
+	start_batch ();
+    }
+}
+
+void
+EditServer::accept_connections ()
+{
+  for (;;)
+    {
+      int fd = accept4 (_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+	{
+	  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR)
+	    return;
+	  if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM)
+	    throw std::system_error (errno, std::generic_category (), "accepting a connection");
+
+	  // Out of file descriptors or memory for now, so stop
+	  // listening for a while rather than spin, and let the clients
+	  // we have finish.
+	  //
+	  epoll_ctl (_epoll_fd, EPOLL_CTL_DEL, _listen_fd, nullptr);
+	  itimerspec timer;
+	  std::memset (&timer, 0, sizeof (timer));
+	  timer.it_value.tv_nsec = 100000000;
+	  timerfd_settime (_accept_timer_fd, 0, &timer, nullptr);
+	  return;
+	}
+
+      uint64_t id = _next_connection_id++;
+      epoll_event event;
+      event.events = EPOLLIN;
+      event.data.u64 = id;
+      if (epoll_ctl (_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+	{
+	  close (fd);
+	  continue;
+	}
+      _connections[id].fd = fd;
+    }
+}
+
+// Read what has arrived on connection ID, up to about MAX_BUFFERED
+// bytes, and add any complete requests to the batch.
+//
+void
+EditServer::read_requests (uint64_t id)
+{
+  auto found = _connections.find (id);
+  if (found == _connections.end ())
+    return;
+  Connection &connection = found->second;
+
+  char buffer[65536];
+  while (! connection.eof && ! throttled (connection) && connection.in.length () < max_buffered)
+    {
+      ssize_t got = read (connection.fd, buffer, sizeof (buffer));
+      if (got > 0)
+	{
+	  connection.in.append (buffer, got);
+	  continue;
+	}
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	connection.eof = true;
+      break;
+    }
+
+  take_requests (id, connection);
+}
+
+// Whether to hold off reading and taking requests from CONNECTION
+// until some of what it has buffered or outstanding has drained.
+//
+bool
+EditServer::throttled (const Connection &connection) const
+{
+  return (connection.outstanding >= _max_batch || connection.out.length () >= max_buffered
+	  || _batch.size () >= _max_batch);
+}
+
+// Add the complete requests read from connection ID to the batch,
+// unless it's throttled, and update what it's watched for.  Nothing
+// more is read from the connection if a request is malformed or too
+// big, though the requests before it are still answered.
+//
+void
+EditServer::take_requests (uint64_t id, Connection &connection)
+{
+  size_t pos = 0;
+  try
+    {
+      Pending pending;
+      pending.connection = id;
+      while (! throttled (connection))
+	{
+	  size_t used = parse_edit_request (connection.in.data () + pos, connection.in.length () - pos,
+					    pending.request);
+	  if (used == 0)
+	    {
+	      // A partial request at the end of the input will never be
+	      // finished.
+	      //
+	      if (connection.eof)
+		pos = connection.in.length ();
+	      break;
+	    }
+	  pos += used;
+	  if (uint64_t (pending.request.from.length () + 1) * (pending.request.to.length () + 1) > _max_cells)
+	    throw std::runtime_error ("edit request too big");
+	  if (_batch.empty () && _batch_window > 0)
+	    {
+	      itimerspec timer;
+	      std::memset (&timer, 0, sizeof (timer));
+	      timer.it_value.tv_sec = _batch_window / 1000000;
+	      timer.it_value.tv_nsec = _batch_window % 1000000 * 1000;
+	      timerfd_settime (_timer_fd, 0, &timer, nullptr);
+	    }
+	  _batch.push_back (std::move (pending));
+	  connection.outstanding++;
+	  if (_batch.size () >= _max_batch || _batch_window == 0)
+	    _batch_due = true;
+	}
+      connection.in.erase (0, pos);
+    }
+  catch (const std::runtime_error &)
+    {
+      connection.in.clear ();
+      connection.eof = true;
+      shutdown (connection.fd, SHUT_RD);
+    }
+
+  update_events (id, connection);
+  close_if_done (id);
+}
+
+// Take any requests the connections were holding back, now that
+// there may be room for them.
+//
+void
+EditServer::resume_connections ()
+{
+  std::vector<uint64_t> ids;
+  for (auto &connection : _connections)
+    ids.push_back (connection.first);
+  for (uint64_t id : ids)
+    {
+      auto found = _connections.find (id);
+      if (found != _connections.end ())
+	take_requests (id, found->second);
+    }
+}
+
+// Send as much of the responses waiting for connection ID as the
+// socket will take, and watch for it being writable if there's more.
+//
+void
+EditServer::write_responses (uint64_t id)
+{
+  auto found = _connections.find (id);
+  if (found == _connections.end ())
+    return;
+  Connection &connection = found->second;
+
+  if (connection.gone)
+    connection.out.clear ();
+  size_t pos = 0;
+  while (pos < connection.out.length ())
+    {
+      ssize_t sent = send (connection.fd, connection.out.data () + pos, connection.out.length () - pos, MSG_NOSIGNAL);
+      if (sent < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+	      pos = connection.out.length ();
+	      connection.gone = connection.eof = true;
+	    }
+	  break;
+	}
+      pos += sent;
+    }
+  connection.out.erase (0, pos);
+  take_requests (id, connection);
+}
+
+// Watch connection ID for reading until the client has finished
+// sending, except while it's throttled, and for writing while there
+// are responses waiting.
+//
+void
+EditServer::update_events (uint64_t id, Connection &connection)
+{
+  uint32_t events = ((connection.eof || throttled (connection) ? 0u : uint32_t (EPOLLIN))
+		     | (connection.out.empty () ? 0u : uint32_t (EPOLLOUT)));
+  if (events == connection.events)
+    return;
+
+  epoll_event event;
+  event.events = events;
+  event.data.u64 = id;
+  int op = events == 0 ? EPOLL_CTL_DEL : connection.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  epoll_ctl (_epoll_fd, op, connection.fd, &event);
+  connection.events = events;
+}
+
+void
+EditServer::close_if_done (uint64_t id)
+{
+  auto found = _connections.find (id);
+  const Connection &connection = found->second;
+  if (connection.eof && connection.outstanding == 0 && connection.out.empty () && connection.in.empty ())
+    {
+      close (connection.fd);
+      _connections.erase (found);
+    }
+}
+
+// Hand the batch being gathered to the workers, split into one slice
+// per worker, each using a workspace of its own.
+//
+void
+EditServer::start_batch ()
+{
+  _batch_due = false;
+  if (_batch.empty ())
+    return;
+
+  itimerspec timer;
+  std::memset (&timer, 0, sizeof (timer));
+  timerfd_settime (_timer_fd, 0, &timer, nullptr);
+
+  _running.swap (_batch);
+  _busy = true;
+
+  size_t num_slices = std::min<size_t> (_pool.size (), _running.size ());
+  auto remaining = std::make_shared<std::atomic<size_t> > (num_slices);
+  for (size_t slice = 0; slice < num_slices; slice++)
+    _pool.submit ([this, slice, num_slices, remaining] ()
+      {
+	static thread_local EditCostWorkspace workspace;
+	for (size_t idx = slice; idx < _running.size (); idx += num_slices)
+	  append_edit_response (_running[idx].response, _running[idx].request, workspace);
+	if (--*remaining == 0)
+	  {
+	    uint64_t one = 1;
+	    if (write (_batch_done_fd, &one, sizeof (one)) < 0)
+	      std::abort ();
+	  }
+      });
+  resume_connections ();
+}
+
+// Wait for the workers to finish the batch they're on, if any, without
+// sending the responses, before shutting down.
+//
+void
+EditServer::wait_for_batch ()
+{
+  while (_busy)
+    {
+      pollfd done = { _batch_done_fd, POLLIN, 0 };
+      uint64_t count;
+      if (poll (&done, 1, -1) > 0 && read (_batch_done_fd, &count, sizeof (count)) == sizeof (count))
+	_busy = false;
+    }
+}
+
+// Queue the responses to the batch the workers have finished.
+//
+void
+EditServer::finish_batch ()
+{
+  std::vector<uint64_t> touched;
+  for (Pending &pending : _running)
+    {
+      auto found = _connections.find (pending.connection);
+      if (found == _connections.end ())
+	continue;
+      found->second.out += pending.response;
+      found->second.outstanding--;
+      touched.push_back (pending.connection);
+    }
+  _running.clear ();
+  _busy = false;
+
+  std::sort (touched.begin (), touched.end ());
+  touched.erase (std::unique (touched.begin (), touched.end ()), touched.end ());
+  for (uint64_t id : touched)
+    write_responses (id);
+  resume_connections ();
+}
+
+
+// Bounded queues
+//
+// A queue for handing work between threads, which makes producers
+// wait while it's full, so a fast stage can't run arbitrarily far
+// ahead of a slow one.  Once closed, nothing more can be pushed, and
+// pop fails when it's empty.
+//
+
+template<class T>
+class BoundedQueue
+{
+public:
+
+  explicit BoundedQueue (size_t capacity)
+    : _capacity (std::max<size_t> (capacity, 1))
+  { }
+
+  // Add ITEM, waiting while the queue is full.  Returns false if the
+  // queue was closed.
+  //
+  bool push (T item)
+  {
+    std::unique_lock<std::mutex> lock (_mutex);
+    _not_full.wait (lock, [this] () { return _closed || _items.size () < _capacity; });
+    if (_closed)
+      return false;
+    _items.push_back (std::move (item));
+    _not_empty.notify_one ();
+    return true;
+  }
+
+  // Remove the first item into ITEM, waiting while the queue is empty.
+  // Returns false if it's empty and closed.
+  //
+  bool pop (T &item)
+  {
+    std::unique_lock<std::mutex> lock (_mutex);
+    _not_empty.wait (lock, [this] () { return _closed || ! _items.empty (); });
+    if (_items.empty ())
+      return false;
+    item = std::move (_items.front ());
+    _items.pop_front ();
+    _not_full.notify_one ();
+    return true;
+  }
+
+  void close ()
+  {
+    std::lock_guard<std::mutex> lock (_mutex);
+    _closed = true;
+    _not_full.notify_all ();
+    _not_empty.notify_all ();
+  }
+
+private:
+
+  size_t _capacity;
+  std::mutex _mutex;
+  std::condition_variable _not_full, _not_empty;
+  std::deque<T> _items;
+  bool _closed = false;
+};
+
+
+// Pipelines
+//
+// For bulk jobs, run_edit_pipeline reads pairs from a stream and
+// writes a result for each to another, in the same order.  Reading,
+// computing and writing overlap: one thread parses chunks of pairs,
+// NUM_THREADS workers compute them, each with its own workspace, and
+// the calling thread writes the results, putting the chunks back in
+// order as they arrive.  Bounded queues between the stages, and a
+// limit on how far workers can get ahead of the chunk being written,
+// keep the memory used proportional to the number of threads.
+//
+// In text mode each line holds FROM and TO separated by a tab, and
+// std_edit_costs are used; each output line has the cost, followed by
+// the edits, separated by tabs, if WANT_EDITS, or for a pair which
+// can't be computed, say because it's too big, "error" and the
+// reason.  In binary mode the input is requests and the output
+// responses, as for EditServer.
+//
+
+struct EditChunk
+{
+  size_t sequence;
+  std::vector<EditRequest> requests;
+  std::string output;
+};
+
+// Read chunks of CHUNK_SIZE requests from IN onto QUEUE, as described
+// for run_edit_pipeline.  Throws std::runtime_error if IN is malformed.
+//
+void
+read_edit_chunks (std::istream &in, bool binary, bool want_edits, size_t chunk_size, BoundedQueue<EditChunk> &queue)
+{
+  EditChunk chunk;
+  chunk.sequence = 0;
+  auto add = [&] (EditRequest &request)
+    {
+      chunk.requests.push_back (std::move (request));
+      if (chunk.requests.size () < chunk_size)
+	return true;
+      size_t sequence = chunk.sequence;
+      if (! queue.push (std::move (chunk)))
+	return false;
+      chunk = EditChunk ();
+      chunk.sequence = sequence + 1;
+      return true;
+    };
+
+  EditRequest request;
+  if (binary)
+    {
+      std::string buffer;
+      size_t pos = 0;
+      char block[65536];
+      while (in.read (block, sizeof (block)) || in.gcount () > 0)
+	{
+	  buffer.erase (0, pos);
+	  buffer.append (block, in.gcount ());
+	  pos = 0;
+	  try
+	    {
+	      while (size_t used = parse_edit_request (buffer.data () + pos, buffer.length () - pos, request))
+		{
+		  pos += used;
+		  if (! add (request))
+		    return;
+		}
+	    }
+	  catch (const std::runtime_error &)
+	    {
+	      queue.push (std::move (chunk));
+	      throw;
+	    }
+	}
+      if (pos != buffer.length ())
+	{
+	  queue.push (std::move (chunk));
+	  throw std::runtime_error ("truncated edit request");
+	}
+    }
+  else
+    {
+      request.costs = std_edit_costs;
+      request.want_edits = want_edits;
+      std::string line;
+      for (size_t line_number = 1; std::getline (in, line); line_number++)
+	{
+	  size_t tab = line.find ('\t');
+	  if (tab == std::string::npos)
+	    {
+	      queue.push (std::move (chunk));
+	      throw std::runtime_error ("line " + std::to_string (line_number) + ": expected FROM<TAB>TO");
+	    }
+	  request.from.assign (line, 0, tab);
+	  request.to.assign (line, tab + 1, std::string::npos);
+	  if (! add (request))
+	    return;
+	}
+    }
+
+  if (! chunk.requests.empty ())
+    queue.push (std::move (chunk));
+}
+
+// Fill in the output for each of the requests in CHUNK.  Like
+// append_edit_response, a pair which can't be computed gets an error
+// line rather than an exception, so it doesn't lose the results of
+// all the others.
+//
+void
+compute_edit_chunk (EditChunk &chunk, bool binary, EditCostWorkspace &workspace)
+{
+  for (const EditRequest &request : chunk.requests)
+    if (binary)
+      append_edit_response (chunk.output, request, workspace);
+    else
+      try
+	{
+	  std::string line;
+	  if (request.want_edits)
+	    {
+	      std::list<Edit> edits = compute_optimal_edits (request.from, request.to, request.costs);
+	      line = std::to_string (edits_cost (edits, request.costs));
+	      for (const Edit &edit : edits)
+		{
+		  line += '\t';
+		  line += edit_rep (edit);
+		}
+	    }
+	  else
+	    line = std::to_string (compute_edit_cost (request.from, request.to, request.costs, workspace));
+	  chunk.output += line;
+	  chunk.output += '\n';
+	}
+      catch (const std::exception &err)
+	{
+	  chunk.output += "error\t";
+	  chunk.output += err.what ();
+	  chunk.output += '\n';
+	}
+  chunk.requests.clear ();
+}
+
+// Read pairs from IN and write their results to OUT, as above, using
+// NUM_THREADS workers, or one per CPU if zero.  Pairs which can't be
+// computed get error results, as above, but this throws
+// std::runtime_error if IN is malformed, after writing the results for
+// the pairs before the problem.
+//
+void
+run_edit_pipeline (std::istream &in, std::ostream &out, bool binary, bool want_edits, unsigned num_threads = 0,
+		   size_t chunk_size = 1024)
+{
+  if (num_threads == 0)
+    num_threads = std::max (1u, std::thread::hardware_concurrency ());
+  BoundedQueue<EditChunk> input (2 * num_threads), output (2 * num_threads);
+
+  // The next chunk to write.  Workers wait to hand over chunks more
+  // than MAX_AHEAD past it, so that while one slow chunk is being
+  // computed, the rest of the input can't pile up waiting behind it.
+  //
+  size_t next_sequence = 0, max_ahead = 2 * num_threads;
+  std::mutex sequence_mutex;
+  std::condition_variable sequence_advanced;
+
+  std::exception_ptr read_error;
+  std::thread reader ([&] ()
+    {
+      try
+	{
+	  read_edit_chunks (in, binary, want_edits, std::max<size_t> (chunk_size, 1), input);
+	}
+      catch (...)
+	{
+	  read_error = std::current_exception ();
+	}
+      input.close ();
+    });
+
+  std::atomic<unsigned> workers_left (num_threads);
+  std::vector<std::thread> workers;
+  for (unsigned thread = 0; thread < num_threads; thread++)
+    workers.emplace_back ([&] ()
+      {
+	EditCostWorkspace workspace;
+	EditChunk chunk;
+	while (input.pop (chunk))
+	  {
+	    compute_edit_chunk (chunk, binary, workspace);
+	    {
+	      std::unique_lock<std::mutex> lock (sequence_mutex);
+	      sequence_advanced.wait (lock, [&] () { return chunk.sequence < next_sequence + max_ahead; });
+	    }
+	    output.push (std::move (chunk));
+	  }
+	if (--workers_left == 0)
+	  output.close ();
+      });
+
+  // The chunks which have arrived ahead of the next one to write.
+  //
+  std::map<size_t, std::string> early;
+  EditChunk chunk;
+  while (output.pop (chunk))
+    {
+      early[chunk.sequence].swap (chunk.output);
+      for (auto next = early.begin (); next != early.end () && next->first == next_sequence; next = early.begin ())
+	{
+	  out.write (next->second.data (), next->second.length ());
+	  early.erase (next);
+	  {
+	    std::lock_guard<std::mutex> lock (sequence_mutex);
+	    next_sequence++;
+	  }
+	  sequence_advanced.notify_all ();
+	}
+    }
+  out.flush ();
+
+  reader.join ();
+  for (std::thread &worker : workers)
+    worker.join ();
+  if (read_error)
+    std::rethrow_exception (read_error);
+}
+
+
+// Asynchronous computation
+//
+// A long compute_optimal_edits call ties up its thread with no way to
+// stop it, so EditExecutor runs them on a worker pool instead, and
+// reports the result through a future, a callback, or with C++20, a
+// coroutine awaitable.  Each computation can be given an
+// EditCancellation, which the computation checks every CHECK_INTERVAL
+// rows of the matrix, giving up with EditCancelled once it's been
+// cancelled or its deadline has passed.  Several computations can
+// share one to be cancelled together.
+//
+
+class EditCancellation
+{
+public:
+
+  typedef std::chrono::steady_clock Clock;
+
+  explicit EditCancellation (Clock::time_point deadline = Clock::time_point::max ())
+    : _deadline (deadline)
+  { }
+
+  void cancel () { _cancelled = true; }
+  bool cancelled () const { return _cancelled; }
+  Clock::time_point deadline () const { return _deadline; }
+  bool deadline_passed () const { return _deadline != Clock::time_point::max () && Clock::now () >= _deadline; }
+
+private:
+
+  std::atomic<bool> _cancelled { false };
+  Clock::time_point _deadline;
+};
+
+class EditCancelled : public std::runtime_error
+{
+public:
+
+  explicit EditCancelled (bool deadline_passed)
+    : std::runtime_error (deadline_passed ? "edit deadline passed" : "edits cancelled"),
+      _deadline_passed (deadline_passed)
+  { }
+
+  bool deadline_passed () const { return _deadline_passed; }
+
+private:
+
+  bool _deadline_passed;
+};
+
+// Throw EditCancelled if CANCELLATION (which may be null) says to stop.
+//
+void
+check_edit_cancellation (const EditCancellation *cancellation)
+{
+  if (cancellation && cancellation->cancelled ())
+    throw EditCancelled (false);
+  if (cancellation && cancellation->deadline_passed ())
+    throw EditCancelled (true);
+}
+
+// A progress policy which checks CANCELLATION every CHECK_INTERVAL
+// rows.
+//
+struct CancellationCheck : NoProgress
+{
+  const EditCancellation *cancellation;
+  unsigned check_interval;
+
+  void row_done (unsigned to_idx)
+  {
+    if ((to_idx + 1) % check_interval == 0)
+      check_edit_cancellation (cancellation);
+  }
+};
+
+// Compute the same optimal edits as compute_optimal_edits, checking
+// CANCELLATION before starting and every CHECK_INTERVAL rows.
+//
+std::list<Edit>
+compute_cancellable_edits (const std::string &from, const std::string &to, const EditCosts &costs,
+			   const EditCancellation *cancellation, unsigned check_interval = 64)
+{
+  check_edit_cancellation (cancellation);
+  CancellationCheck check;
+  check.cancellation = cancellation;
+  check.check_interval = std::max (check_interval, 1u);
+  UniformCosts uniform_costs (costs, from);
+  return compute_optimal_edits_with (from, to, uniform_costs, check);
+}
+
+typedef std::function<void (std::list<Edit> edits, std::exception_ptr error)> EditCallback;
+
+class EditExecutor
+{
+public:
+
+  // Run computations on NUM_THREADS threads, or one per CPU if zero.
+  // Computations still queued when the executor is destroyed are run
+  // first.
+  //
+  explicit EditExecutor (unsigned num_threads = 0, unsigned check_interval = 64)
+    : _pool (num_threads), _check_interval (check_interval)
+  { }
+
+  // Start computing the optimal edits from FROM to TO with COSTS, and
+  // return a future for them, or call DONE with them, or with the
+  // exception that stopped them, on the worker thread.  CANCELLATION
+  // may be null.
+  //
+  std::future<std::list<Edit> > submit (const std::string &from, const std::string &to, const EditCosts &costs,
+					std::shared_ptr<const EditCancellation> cancellation = nullptr)
+  {
+    auto promise = std::make_shared<std::promise<std::list<Edit> > > ();
+    std::future<std::list<Edit> > result = promise->get_future ();
+    submit (from, to, costs, [promise] (std::list<Edit> edits, std::exception_ptr error)
+      {
+	if (error)
+	  promise->set_exception (error);
+	else
+	  promise->set_value (std::move (edits));
+      }, std::move (cancellation));
+    return result;
+  }
+
+  void submit (const std::string &from, const std::string &to, const EditCosts &costs, EditCallback done,
+	       std::shared_ptr<const EditCancellation> cancellation = nullptr)
+  {
+    unsigned check_interval = _check_interval;
+    _pool.submit ([from, to, costs, done, cancellation, check_interval] ()
+      {
+	std::list<Edit> edits;
+	std::exception_ptr error;
+	try
+	  {
+	    edits = compute_cancellable_edits (from, to, costs, cancellation.get (), check_interval);
+	  }
+	catch (...)
+	  {
+	    error = std::current_exception ();
+	  }
+	done (std::move (edits), error);
+      });
+  }
+
+#if defined (__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+  // An awaitable for the optimal edits, for use in a coroutine, which
+  // is resumed on the worker thread.
+  //
+  class Awaitable
+  {
+  public:
+
+    Awaitable (EditExecutor &executor, std::string from, std::string to, const EditCosts &costs,
+	       std::shared_ptr<const EditCancellation> cancellation)
+      : _executor (executor), _from (std::move (from)), _to (std::move (to)), _costs (costs),
+	_cancellation (std::move (cancellation))
+    { }
+
+    bool await_ready () const { return false; }
+
+    void await_suspend (std::coroutine_handle<> waiter)
+    {
+      _executor.submit (_from, _to, _costs, [this, waiter] (std::list<Edit> edits, std::exception_ptr error)
+	{
+	  _edits = std::move (edits);
+	  _error = error;
+	  waiter.resume ();
+	}, _cancellation);
+    }
+
+    std::list<Edit> await_resume ()
+    {
+      if (_error)
+	std::rethrow_exception (_error);
+      return std::move (_edits);
+    }
+
+  private:
+
+    EditExecutor &_executor;
+    std::string _from, _to;
+    EditCosts _costs;
+    std::shared_ptr<const EditCancellation> _cancellation;
+    std::list<Edit> _edits;
+    std::exception_ptr _error;
+  };
+
+  Awaitable edits (std::string from, std::string to, const EditCosts &costs,
+		   std::shared_ptr<const EditCancellation> cancellation = nullptr)
+  {
+    return Awaitable (*this, std::move (from), std::move (to), costs, std::move (cancellation));
+  }
+
+#endif
+
+private:
+
+  WorkerPool _pool;
+  unsigned _check_interval;
+};
+
+
+// Progress reporting
+//
+// For long comparisons, ProgressReporter is a progress policy which
+// calls a callback with an EditProgress every INTERVAL rows of the
+// matrix and edits of the traceback, and once more at the end.
+//
+
+struct EditProgress
+{
+  // Whether the edits are being traced back, rather than the matrix
+  // being filled in.
+  //
+  bool traceback = false;
+
+  // The entries of the matrix filled in so far and altogether, and
+  // the edits found so far in the traceback and at most how many
+  // there can be.
+  //
+  uint64_t cells_done = 0, cells_total = 0;
+  uint64_t steps_done = 0, steps_max = 0;
+
+  // The seconds since the start, and the rate at which entries have
+  // been filled in since the last report.
+  //
+  double elapsed = 0, cells_per_second = 0;
+};
+
+template<class Callback>
+class ProgressReporter
+{
+public:
+
+  typedef std::chrono::steady_clock Clock;
+
+  explicit ProgressReporter (Callback callback, unsigned interval = 256)
+    : _callback (callback), _interval (std::max (interval, 1u))
+  { }
+
+  void start (unsigned from_length, unsigned to_length)
+  {
+    _progress = EditProgress ();
+    _row_cells = from_length + 1;
+    _to_length = to_length;
+    _progress.cells_total = uint64_t (to_length + 1) * _row_cells;
+    _progress.steps_max = uint64_t (from_length) + to_length;
+    _start = _last = Clock::now ();
+    _last_cells = 0;
+  }
+
+  void row_done (unsigned to_idx)
+  {
+    if ((to_idx + 1) % _interval == 0 || to_idx + 1 == _to_length)
+      {
+	_progress.cells_done = uint64_t (to_idx + 2) * _row_cells;
+	report ();
+      }
+  }
+
+  void fill_done () { }
+
+  void step_done ()
+  {
+    _progress.traceback = true;
+    _progress.cells_done = _progress.cells_total;
+    if (++_progress.steps_done % _interval == 0)
+      report ();
+  }
+
+  void finish ()
+  {
+    _progress.traceback = true;
+    _progress.cells_done = _progress.cells_total;
+    report ();
+  }
+
+private:
+
+  void report ()
+  {
+    Clock::time_point now = Clock::now ();
+    double since_last = std::chrono::duration<double> (now - _last).count ();
+    if (_progress.cells_done > _last_cells && since_last > 0)
+      _progress.cells_per_second = (_progress.cells_done - _last_cells) / since_last;
+    _progress.elapsed = std::chrono::duration<double> (now - _start).count ();
+    _last = now;
+    _last_cells = _progress.cells_done;
+    _callback (_progress);
+  }
+
+  Callback _callback;
+  unsigned _interval;
+  uint64_t _row_cells = 0;
+  unsigned _to_length = 0;
+  EditProgress _progress;
+  Clock::time_point _start, _last;
+  uint64_t _last_cells = 0;
+};
+
+template<class Callback>
+ProgressReporter<Callback>
+make_progress_reporter (Callback callback, unsigned interval = 256)
+{
+  return ProgressReporter<Callback> (callback, interval);
+}
+
+// Compute the same optimal edits as compute_optimal_edits, telling
+// the progress policy PROGRESS how it's going.
+//
+template<class Progress>
+std::list<Edit>
+compute_reported_edits (const std::string &from, const std::string &to, const EditCosts &costs, Progress &progress)
+{
+  UniformCosts uniform_costs (costs, from);
+  return compute_optimal_edits_with (from, to, uniform_costs, progress);
+}
+
+
+// Statistics
+//
+// To see how the full-matrix computation is doing in production,
+// compute_measured_edits fills in an EditStats as it goes, using a
+// progress policy, so it takes no more time than compute_optimal_edits
+// beyond reading the clock three times.
+//
+
+struct EditStats
+{
+  // Which fill kernel was used.
+  //
+  std::string kernel;
+
+  // The entries of the matrix filled in, an estimate of the bytes
+  // allocated for the matrix and the edits, worked out from their
+  // sizes rather than measured, and the most taken by the matrix at
+  // once.
+  //
+  uint64_t cells = 0;
+  size_t bytes_estimated = 0, peak_matrix_bytes = 0;
+
+  double fill_seconds = 0, traceback_seconds = 0;
+
+  // Giga (10^9) cell updates per second during the fill.
+  //
+  double gcups () const { return fill_seconds > 0 ? cells / fill_seconds / 1e9 : 0; }
+};
+
+// Return STATS as a single-line JSON object.
+//
+std::string
+edit_stats_json (const EditStats &stats)
+{
+  char numbers[256];
+  snprintf (numbers, sizeof (numbers),
+	    "\"cells\":%llu,\"bytes_estimated\":%llu,\"peak_matrix_bytes\":%llu,"
+	    "\"fill_seconds\":%.9g,\"traceback_seconds\":%.9g,\"gcups\":%.6g",
+	    (unsigned long long) stats.cells, (unsigned long long) stats.bytes_estimated,
+	    (unsigned long long) stats.peak_matrix_bytes, stats.fill_seconds, stats.traceback_seconds, stats.gcups ());
+
+  // Kernel names are plain words, but escape them anyway.
+  //
+  std::string json = "{\"kernel\":\"";
+  for (char ch : stats.kernel)
+    {
+      if (ch == '"' || ch == '\\')
+	json += '\\';
+      json += ch;
+    }
+  return json + "\"," + numbers + "}";
+}
+
+// A progress policy which fills in an EditStats.
+//
+class EditStatsRecorder : public NoProgress
+{
+public:
+
+  typedef std::chrono::steady_clock Clock;
+
+  explicit EditStatsRecorder (EditStats &stats)
+    : _stats (stats)
+  { }
+
+  // The trace and three rows of costs are allocated up front, and the
+  // edits, a list node each, as the traceback goes.
+  //
+  void start (unsigned from_length, unsigned to_length)
+  {
+    size_t row_length = from_length + 1;
+    _stats.cells = uint64_t (to_length + 1) * row_length;
+    _stats.peak_matrix_bytes = (to_length + 1) * row_length + 3 * row_length * sizeof (unsigned);
+    _stats.bytes_estimated = _stats.peak_matrix_bytes;
+    _steps = 0;
+    _start = Clock::now ();
+  }
+
+  void fill_done ()
+  {
+    _fill_end = Clock::now ();
+  }
+
+  void step_done ()
+  {
+    _steps++;
+  }
+
+  void finish ()
+  {
+    Clock::time_point end = Clock::now ();
+    _stats.fill_seconds = std::chrono::duration<double> (_fill_end - _start).count ();
+    _stats.traceback_seconds = std::chrono::duration<double> (end - _fill_end).count ();
+    _stats.bytes_estimated += _steps * (sizeof (Edit) + 2 * sizeof (void *));
+  }
+
+private:
+
+  EditStats &_stats;
+  uint64_t _steps = 0;
+  Clock::time_point _start, _fill_end;
+};
+
+// Compute the same optimal edits as compute_optimal_edits, filling in
+// STATS.
+//
+std::list<Edit>
+compute_measured_edits (const std::string &from, const std::string &to, const EditCosts &costs, EditStats &stats)
+{
+  stats = EditStats ();
+  stats.kernel = costs[TRANSPOSE] == DISALLOWED ? "full-matrix/uniform" : "full-matrix/uniform+transpose";
+  EditStatsRecorder recorder (stats);
+  UniformCosts uniform_costs (costs, from);
+  return compute_optimal_edits_with (from, to, uniform_costs, recorder);
+}
+
+std::list<Edit>
+compute_measured_edits (const std::string &from, const std::string &to, const CostTable &costs, EditStats &stats)
+{
+  stats = EditStats ();
+  stats.kernel = costs.transpose_cost == DISALLOWED ? "full-matrix/table" : "full-matrix/table+transpose";
+  EditStatsRecorder recorder (stats);
+  TableCosts table_costs (costs, from);
+  return compute_optimal_edits_with (from, to, table_costs, recorder);
+}
+
+
+// Parse the command line argument ARG as a decimal number of at most
+// MAX into VALUE.  Returns false if it's anything else, including
+// empty, signed or out of range.
+//
+bool
+parse_number_arg (const char *arg, unsigned long max, unsigned long &value)
+{
+  char *end;
+  errno = 0;
+  value = std::strtoul (arg, &end, 10);
+  return std::isdigit ((unsigned char) *arg) && ! *end && errno != ERANGE && value <= max;
+}
+
+// Usage: optedit --search [-e] PATTERN MAX_COST < TEXT
+//
+// Print the end position and cost of each occurrence of PATTERN in
+// the standard input costing at most MAX_COST, and with -e, its start
+// position and edits too.  A MAX_COST of 4294967295 (DISALLOWED)
+// means there's no limit.
+//
+int
+search_main (int argc, const char **argv)
+{
+  bool want_edits = argc == 5 && std::string (argv[2]) == "-e";
+  const char *pattern = argv[argc - 2];
+  const char *max_cost_arg = argv[argc - 1];
+
+  unsigned long max_cost;
+  if (! parse_number_arg (max_cost_arg, DISALLOWED, max_cost))
+    {
+      std::cerr << argv[0] << ": invalid MAX_COST " << max_cost_arg << '\n';
+      return 1;
+    }
+
+  std::ios::sync_with_stdio (false);
+  ApproximateSearch search (pattern, std_edit_costs, max_cost, want_edits);
+  search_stream (std::cin, search, [&] (const SearchHit &hit)
+    {
+      if (want_edits)
+	{
+	  std::cout << hit.start << ' ' << hit.end << ' ' << hit.cost << '\n';
+	  for (const Edit &edit : hit.edits)
+	    std::cout << "  " << edit_rep (edit) << '\n';
+	}
+      else
+	std::cout << hit.end << ' ' << hit.cost << '\n';
+    });
+  return 0;
+}
+
+// Usage: optedit --index build INDEX < WORDS
+//        optedit --index query INDEX WORD MAX_COST
+//        optedit --index nearest INDEX WORD COUNT
+//
+// Build an index of the words, one per line, on the standard input,
+// or print the cost and word of each indexed word whose optimal edits
+// from WORD cost at most MAX_COST, or of the COUNT cheapest.
+//
+int
+index_main (int, const char **argv)
+{
+  std::string command = argv[2], path = argv[3];
+  try
+    {
+      if (command == "build")
+	{
+	  BKTree tree (std_edit_costs);
+	  std::string word;
+	  while (std::getline (std::cin, word))
+	    tree.add (word);
+	  tree.save (path);
+	  return 0;
+	}
+
+      unsigned long limit;
+      if (! parse_number_arg (argv[5], DISALLOWED, limit))
+	{
+	  std::cerr << argv[0] << ": invalid " << (command == "query" ? "MAX_COST " : "COUNT ") << argv[5] << '\n';
+	  return 1;
+	}
+
+      BKTree tree = BKTree::load (path);
+      size_t visited;
+      std::vector<DictionaryMatch> matches = (command == "query"
+					      ? tree.search (argv[4], limit, &visited)
+					      : tree.nearest (argv[4], limit, &visited));
+      for (const DictionaryMatch &match : matches)
+	std::cout << match.cost << ' ' << tree.word (match.word) << '\n';
+      std::cerr << "compared against " << visited << " of " << tree.size () << " words\n";
+      return 0;
+    }
+  catch (const std::exception &err)
+    {
+      std::cerr << argv[0] << ": " << err.what () << '\n';
+      return 1;
+    }
+}
+
+// Usage: optedit --matrix OUTPUT < STRINGS
+//
+// Write the costs between each pair of the strings, one per line, on
+// the standard input to OUTPUT, in the all-pairs layout.
+//
+int
+matrix_main (int, const char **argv)
+{
+  std::vector<std::string> strings;
+  std::string line;
+  while (std::getline (std::cin, line))
+    strings.push_back (line);
+  try
+    {
+      compute_all_pairs (strings, std_edit_costs, argv[2]);
+      return 0;
+    }
+  catch (const std::exception &err)
+    {
+      std::cerr << argv[0] << ": " << err.what () << '\n';
+      return 1;
+    }
+}
+
+// Usage: optedit --serve SOCKET
+//
+// Answer requests in the binary format on a Unix domain socket at
+// SOCKET until killed.
+//
+int
+serve_main (int, const char **argv)
+{
+  try
+    {
+      EditServer server (argv[2]);
+      server.run ();
+      return 0;
+    }
+  catch (const std::exception &err)
+    {
+      std::cerr << argv[0] << ": " << err.what () << '\n';
+      return 1;
+    }
+}
+
+// Usage: optedit --pipe [-b] [-e] [-j THREADS]
+//
+// Read pairs from the standard input and write their results to the
+// standard output, in text mode or with -b, binary mode, as described
+// for run_edit_pipeline.  With -e, text mode results include the
+// edits, and with -j, THREADS workers are used, at most
+// MAX_PIPE_THREADS; the default, or 0, is one per CPU.
+//
+const unsigned max_pipe_threads = 1024;
+
+int
+pipe_main (int argc, const char **argv)
+{
+  bool binary = false, want_edits = false;
+  unsigned num_threads = 0;
+  for (int arg = 2; arg < argc; arg++)
+    {
+      std::string option = argv[arg];
+      if (option == "-b")
+	binary = true;
+      else if (option == "-e")
+	want_edits = true;
+      else if (option == "-j" && arg + 1 < argc)
+	{
+	  unsigned long threads;
+	  if (! parse_number_arg (argv[++arg], max_pipe_threads, threads))
+	    {
+	      std::cerr << argv[0] << ": invalid THREADS " << argv[arg]
+			<< " (at most " << max_pipe_threads << ")\n";
+	      return 1;
+	    }
+	  num_threads = threads;
+	}
+      else
+	{
+	  std::cerr << argv[0] << ": unknown pipe option " << option << '\n';
+	  return 1;
+	}
+    }
+
+  std::ios::sync_with_stdio (false);
+  try
+    {
+      run_edit_pipeline (std::cin, std::cout, binary, want_edits, num_threads);
+      return 0;
+    }
+  catch (const std::exception &err)
+    {
+      std::cerr << argv[0] << ": " << err.what () << '\n';
+      return 1;
+    }
+}
+
+// Every mode other than comparing FROM and TO is selected by an
+// option starting with "--", and anything else is taken as FROM and
+// TO; to compare a FROM string starting with "--", put "--" first.
+//
+int main (int argc, const char **argv)
+{
+  const char *program = argv[0];
+  std::string mode = argc > 1 ? argv[1] : "";
+
+  if (mode == "--search" && argc >= 4 && argc <= 5 && (argc == 4 || std::string (argv[2]) == "-e"))
+    return search_main (argc, argv);
+
+  if (mode == "--index"
+      && ((argc == 4 && std::string (argv[2]) == "build")
+	  || (argc == 6 && (std::string (argv[2]) == "query" || std::string (argv[2]) == "nearest"))))
+    return index_main (argc, argv);
+
+  if (mode == "--matrix" && argc == 3)
+    return matrix_main (argc, argv);
+
+  if (mode == "--serve" && argc == 3)
+    return serve_main (argc, argv);
+
+  if (mode == "--pipe")
+    return pipe_main (argc, argv);
+
+  // With --stats, the statistics for the computation are written to
+  // the standard error as JSON.
+  //
+  bool want_stats = mode == "--stats";
+  if (want_stats)
+    {
+      argv++;
+      argc--;
+    }
+  bool bad_option = false;
+  if (argc > 1 && std::string (argv[1]) == "--")
+    {
+      argv++;
+      argc--;
+    }
+  else if (argc > 1 && std::string (argv[1]).compare (0, 2, "--") == 0)
+    bad_option = true;
+
+  if (argc != 3 || bad_option)
+    {
+      argv[0] = program;
+      std::cerr << "Usage: " << argv[0] << " [--stats] [--] FROM TO\n"
+		<< "       " << argv[0] << " --search [-e] PATTERN MAX_COST < TEXT\n"
+		<< "       " << argv[0] << " --index build INDEX < WORDS\n"
+		<< "       " << argv[0] << " --index query INDEX WORD MAX_COST\n"
+		<< "       " << argv[0] << " --index nearest INDEX WORD COUNT\n"
+		<< "       " << argv[0] << " --matrix OUTPUT < STRINGS\n"
+		<< "       " << argv[0] << " --serve SOCKET\n"
+		<< "       " << argv[0] << " --pipe [-b] [-e] [-j THREADS] < PAIRS\n";
+      return 1;
+    }
+  EditStats stats;
+  std::list<Edit> edits = (want_stats
+			   ? compute_measured_edits (argv[1], argv[2], std_edit_costs, stats)
+			   : compute_optimal_edits (argv[1], argv[2], std_edit_costs));
   for (const Edit &edit : edits)
     {
       std::cout << edit_rep (edit) << '\n';
     }
+  if (want_stats)
+    std::cerr << edit_stats_json (stats) << '\n';
 }